@@ -0,0 +1,335 @@
+#!/bin/bash
+
+#  Title          : bench.sh
+#  Author         : Brandon Cohen
+#  Created on     : December 21, 2023
+#  Description    : A script that builds the tools, generates the same inputs on every run, and times each tool on them.
+#                   Wall time, throughput, peak RSS, system calls and a checksum of the output are compared against a
+#                   baseline file, and the script exits with 1 if any of them got worse.
+#  Purpose        : To catch a change that slows down a hot path or changes what a tool prints
+#  Usage          : ./bench.sh
+#  Build with     : ./bench.sh [-n runs] [-s scale] [-t percent] [-b baseline] [-u] [-k] [case ...]
+#  Modifications  : Uses the tools' --stats for peak RSS and call counts when GNU time or strace is missing.
+
+# -n runs      Times each case this many times and keeps the median (default 3)
+# -s scale     Multiplies every input size (default 1)
+# -t percent   How much worse than the baseline a number may get (default 25)
+# -b baseline  Baseline file (default bench.baseline next to this script)
+# -u           Writes the results as the new baseline instead of comparing
+# -k           Keeps the work directory with the inputs and outputs
+# case ...     Runs only the cases whose names start with these words, like diffdate or myseq_int
+#
+# Peak RSS comes from GNU time at /usr/bin/time and the system call count from strace. Without
+# them the tools are run with --stats, which reports their peak RSS and counts the reads, writes,
+# seeks, statx() and copy_file_range() calls they make themselves. The baseline belongs to the
+# machine it was made on.
+
+src=$(cd "$(dirname "$0")" && pwd)
+runs=3
+scale=1
+threshold=25
+baseline="$src/bench.baseline"
+update=0
+keep=0
+
+usage() {
+    echo "./bench.sh [-n runs] [-s scale] [-t percent] [-b baseline] [-u] [-k] [case ...]"
+    exit 1
+}
+
+while getopts "n:s:t:b:uk" opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        s) scale=$OPTARG ;;
+        t) threshold=$OPTARG ;;
+        b) baseline=$OPTARG ;;
+        u) update=1 ;;
+        k) keep=1 ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+for n in "$runs" "$scale" "$threshold"; do
+    if [[ ! $n =~ ^[0-9]+$ ]] || [ "$n" -eq 0 ]; then
+        echo "$n is not a positive integer."
+        usage
+    fi
+done
+
+# Same output on every machine: no locale, and times printed in UTC
+export LC_ALL=C TZ=UTC
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/bench.XXXXXX") || exit 1
+if [ "$keep" -eq 1 ]; then
+    echo "Work directory: $work"
+else
+    trap 'rm -rf "$work"' EXIT
+fi
+mkdir -p "$work/bin" "$work/in"
+
+# Build every tool the way its header says
+build() {
+    local name=$1
+    shift
+    if ! gcc -O2 "$@" "$src/$name.c" -o "$work/bin/$name" 2> "$work/build.log"; then
+        echo "Building $name failed:"
+        cat "$work/build.log"
+        exit 1
+    fi
+}
+
+build myseq -pthread
+build diffdate -pthread
+build fcompare
+build logtimes
+build bkupfiles -pthread
+build genrand -pthread
+
+bin=$work/bin
+in=$work/in
+
+
+# Inputs. Every generator uses a fixed seed, so the inputs and the output checksums only
+# change when the scale does.
+
+# Pairs of dates, and one line in a hundred that is not a date
+perl -e '
+    my ($n, $x) = ($ARGV[0], 1);
+    sub r { $x = ($x * 69069 + 1) % 4294967296; return $x >> 8 }
+    for (1 .. $n) {
+        if (r() % 100 == 0) { print "not-a-date\n"; next }
+        printf "%04d-%02d-%02d %04d-%02d-%02d\n",
+            1900 + r() % 200, 1 + r() % 12, 1 + r() % 28,
+            1900 + r() % 200, 1 + r() % 12, 1 + r() % 28;
+    }' $((1000000 * scale)) > "$in/pairs.txt"
+
+# A directory of files with different sizes and times
+perl -e '
+    my ($dir, $n, $x) = ($ARGV[0], $ARGV[1], 7);
+    sub r { $x = ($x * 69069 + 1) % 4294967296; return $x >> 8 }
+    mkdir $dir;
+    for my $i (1 .. $n) {
+        my $f = sprintf "%s/f%06d", $dir, $i;
+        open my $fh, ">", $f or die "$f: $!";
+        print $fh "x" x (r() % 4096);
+        close $fh;
+        my $t = 1000000000 + r() % 700000000;
+        utime $t, $t, $f;
+    }' "$in/tree" $((5000 * scale))
+
+# A wtmp file of logins and logouts for 50 users on 16 terminals. logtimes keeps its users in a
+# list it walks for every session, so this one grows slower than the others.
+perl -e '
+    my ($n, $x, $t) = ($ARGV[0], 3, 1500000000);
+    sub r { $x = ($x * 69069 + 1) % 4294967296; return $x >> 8 }
+    sub rec { pack "s x2 l a32 a4 a32 a256 s s l l l a16 a20", $_[0], 1, $_[1], "", $_[2], "", 0, 0, 0, $_[3], 0, "", "" }
+    for (1 .. $n) {
+        my ($line, $user, $len) = ("pts/" . r() % 16, "user" . r() % 50, r() % 36000);
+        print rec(7, $line, $user, $t), rec(8, $line, "", $t + $len);
+        $t += $len + 1;
+    }' $((10000 * scale)) > "$in/wtmp"
+
+# Files of shuffled numbers for the backups
+files=()
+for i in 1 2 3 4; do
+    "$bin/genrand" --seed "$i" $((1000000 * scale)) "$in/data$i"
+    files+=("$in/data$i")
+done
+
+
+# Cases: name, the files whose size gives the throughput ("out" for the output), and the command.
+# A case with a clean_<name> function has it run before every run, and one with a sum_<name>
+# function is checksummed by it instead of by its output.
+names=()
+declare -A sizes cmds
+
+add_case() {
+    names+=("$1")
+    sizes[$1]=$2
+    cmds[$1]=$3
+}
+
+add_case myseq_int        out                "$bin/myseq 1 $((5000000 * scale))"
+add_case myseq_j4         out                "$bin/myseq -j 4 1 $((5000000 * scale))"
+add_case myseq_fixed      out                "$bin/myseq -w 0.25 0.25 $((1000000 * scale))"
+add_case myseq_printf     out                "$bin/myseq -f '%e' 1 $((200000 * scale))"
+add_case diffdate_stdin   "$in/pairs.txt"    "$bin/diffdate --batch < $in/pairs.txt"
+add_case diffdate_file    "$in/pairs.txt"    "$bin/diffdate --batch $in/pairs.txt"
+add_case diffdate_j4      "$in/pairs.txt"    "$bin/diffdate --batch -j 4 $in/pairs.txt"
+add_case diffdate_summary "$in/pairs.txt"    "$bin/diffdate --batch --summary $in/pairs.txt"
+add_case fcompare_mtime   out                "$bin/fcompare -m $in/tree/*"
+add_case fcompare_size    out                "$bin/fcompare -s -r $in/tree/*"
+add_case logtimes         "$in/wtmp"         "$bin/logtimes -f $in/wtmp user7"
+add_case bkupfiles_copy   "${files[*]}"      "$bin/bkupfiles -j 4 ${files[*]}"
+add_case bkupfiles_zip    "${files[*]}"      "$bin/bkupfiles -j 4 -z ${files[*]}"
+add_case bkupfiles_dedup  "${files[*]}"      "$bin/bkupfiles -j 4 -d $work/store ${files[*]}"
+add_case genrand          out                "$bin/genrand --seed 9 $((2000000 * scale)) /dev/stdout"
+
+clean_bkupfiles_copy()  { rm -f "$in"/data*.bck; }
+clean_bkupfiles_zip()   { rm -f "$in"/data*.bckz; }
+clean_bkupfiles_dedup() { rm -rf "$in"/data*.bckr "$work/store"; }
+
+sum_bkupfiles_copy()  { cat "$in"/data*.bck | cksum; }
+sum_bkupfiles_zip()   { cat "$in"/data*.bckz | cksum; }
+sum_bkupfiles_dedup() { cat "$in"/data*.bckr | cksum; }
+
+
+have_time=0
+have_strace=0
+[ -x /usr/bin/time ] && /usr/bin/time -f %M true 2> /dev/null && have_time=1
+command -v strace > /dev/null && have_strace=1
+
+now_us() {
+    if [ -n "$EPOCHREALTIME" ]; then
+        echo "${EPOCHREALTIME/./}"
+    else
+        echo $(( $(date +%s%N) / 1000 ))
+    fi
+}
+
+# The command with --stats after the program name
+with_stats() {
+    local cmd=${cmds[$1]}
+    echo "${cmd%% *} --stats ${cmd#* }"
+}
+
+# A field of the --stats line the last run printed
+stats_field() {
+    grep -o "^stats: .*" "$work/err" | tr ' ' '\n' | awk -F= -v k="$1" '$1 == k { print $2 }'
+}
+
+# Run one case once. Prints its wall time in microseconds and its peak RSS in KiB.
+run_once() {
+    local name=$1 start end rss=-
+    declare -F "clean_$name" > /dev/null && "clean_$name"
+
+    start=$(now_us)
+    if [ "$have_time" -eq 1 ]; then
+        /usr/bin/time -f %M -o "$work/rss" sh -c "exec ${cmds[$name]}" > "$work/out" 2> "$work/err"
+    else
+        sh -c "exec $(with_stats "$name")" > "$work/out" 2> "$work/err"
+    fi
+    local rc=$?
+    end=$(now_us)
+
+    if [ "$have_time" -eq 1 ]; then
+        rss=$(tail -n 1 "$work/rss")
+    else
+        rss=$(stats_field peak_rss_kb)
+    fi
+    echo "$((end - start)) ${rss:--} $rc"
+}
+
+# Count the system calls of one run, or take the count from the last run's --stats line
+count_syscalls() {
+    local name=$1
+    if [ "$have_strace" -eq 0 ]; then
+        [ "$have_time" -eq 0 ] && stats_field syscalls || echo -
+        return
+    fi
+    declare -F "clean_$name" > /dev/null && "clean_$name"
+    strace -f -c -o "$work/strace" sh -c "exec ${cmds[$name]}" > /dev/null 2>&1
+    awk '$NF == "total" { print $4 }' "$work/strace"
+}
+
+# Say whether new is more than threshold percent above old. Times under 5 ms are noise.
+worse() {
+    local old=$1 new=$2 floor=$3
+    [ "$old" = - ] || [ "$new" = - ] && return 1
+    awk -v o="$old" -v n="$new" -v t="$threshold" -v f="$floor" \
+        'BEGIN { exit !(n > o * (1 + t / 100) && n - o > f) }'
+}
+
+declare -A base_wall base_rss base_calls base_sum
+if [ "$update" -eq 0 ] && [ -f "$baseline" ]; then
+    while read -r name wall rss calls sum; do
+        [[ $name = \#* ]] && continue
+        base_wall[$name]=$wall
+        base_rss[$name]=$rss
+        base_calls[$name]=$calls
+        base_sum[$name]=$sum
+    done < "$baseline"
+fi
+
+selected() {
+    [ "$#" -eq 1 ] && return 0
+    local name=$1 word
+    shift
+    for word in "$@"; do
+        [[ $name = "$word"* ]] && return 0
+    done
+    return 1
+}
+
+results="$work/results"
+echo "# name wall_ms peak_rss_kb syscalls checksum" > "$results"
+printf "%-18s %10s %10s %10s %10s  %s\n" case wall_ms MB/s rss_kb syscalls status
+failed=0
+
+for name in "${names[@]}"; do
+    selected "$name" "$@" || continue
+
+    walls=()
+    rss=-
+    for ((r = 0; r < runs; r++)); do
+        read -r us kb rc <<< "$(run_once "$name")"
+        # diffdate exits with 1 because some lines of its input are not dates
+        if [ "$rc" -ne 0 ] && [[ $name != diffdate* ]]; then
+            echo "$name exited with $rc:"
+            cat "$work/err"
+            failed=1
+        fi
+        walls+=("$us")
+        if [ "$kb" != - ] && { [ "$rss" = - ] || [ "$kb" -gt "$rss" ]; }; then
+            rss=$kb
+        fi
+    done
+
+    # The median run, in milliseconds
+    wall=$(printf "%s\n" "${walls[@]}" | sort -n | awk '{ a[NR] = $1 } END { printf "%.1f", a[int((NR + 1) / 2)] / 1000 }')
+
+    if declare -F "sum_$name" > /dev/null; then
+        sum=$("sum_$name" | awk '{ print $1 }')
+    else
+        sum=$(cksum < "$work/out" | awk '{ print $1 }')
+    fi
+
+    if [ "${sizes[$name]}" = out ]; then
+        bytes=$(wc -c < "$work/out")
+    else
+        bytes=$(cat ${sizes[$name]} | wc -c)
+    fi
+    rate=$(awk -v b="$bytes" -v ms="$wall" 'BEGIN { printf "%.1f", (ms > 0 ? b / 1048576 / (ms / 1000) : 0) }')
+
+    calls=$(count_syscalls "$name")
+
+    status=ok
+    if [ "$update" -eq 0 ]; then
+        if [ -z "${base_wall[$name]}" ]; then
+            status=new
+        else
+            problems=()
+            worse "${base_wall[$name]}" "$wall" 5 && problems+=("wall ${base_wall[$name]} ms")
+            worse "${base_rss[$name]}" "$rss" 1024 && problems+=("rss ${base_rss[$name]} KiB")
+            worse "${base_calls[$name]}" "$calls" 16 && problems+=("syscalls ${base_calls[$name]}")
+            [ "${base_sum[$name]}" != "$sum" ] && problems+=("output changed")
+            if [ "${#problems[@]}" -gt 0 ]; then
+                status="WORSE: $(IFS=,; echo "${problems[*]}" | sed 's/,/, /g')"
+                failed=1
+            fi
+        fi
+    fi
+
+    printf "%-18s %10s %10s %10s %10s  %s\n" "$name" "$wall" "$rate" "$rss" "$calls" "$status"
+    echo "$name $wall $rss $calls $sum" >> "$results"
+done
+
+if [ "$update" -eq 1 ]; then
+    cp "$results" "$baseline"
+    echo "Baseline written to $baseline"
+elif [ ! -f "$baseline" ]; then
+    echo "No baseline at $baseline; run ./bench.sh -u to make one."
+fi
+
+exit $failed
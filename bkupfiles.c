@@ -0,0 +1,1773 @@
+/*
+#  Title          : bkupfiles.c
+#  Author         : Brandon Cohen
+#  Created on     : October 2, 2023
+#  Description    : A C program that creates a backup file with the ending .bck. Paramters are unlimited, but they must be a file.
+#  Purpose        : A native replacement for bkupfiles.sh, which runs one cp at a time.
+#  Usage          : ./bkupfiles [-j threads] [-v] [-i] [-m manifest] [-d store | -z] [-R] [--stats] [file1] [file2] [file3] ... [fileN]
+#  Build with     : gcc -O2 -pthread bkupfiles.c -o bkupfiles
+#  Modifications  : Added -i, incremental backups that skip unchanged files and rewrite only changed blocks.
+#                   Added -d, a deduplicating chunk store, and -R to restore files from it.
+#                   Added -z, compressed backups with a block index.
+#                   Sparse files keep their holes, and -v reports the bytes each copy moved.
+#                   Added --stats.
+*/
+
+/*
+Each file is copied to file.bck by the cheapest method the file system allows. A FICLONE reflink
+shares the data blocks and copies nothing. Failing that, copy_file_range() copies inside the kernel
+without passing the data through user space. As a last resort the file is copied with large
+read() and write() calls. A file with fewer blocks allocated than its size has holes, so only
+its data extents, found with SEEK_DATA and SEEK_HOLE, are copied and the holes are left in the
+.bck as well. -v prints the logical size and the bytes actually copied for each file.
+
+Files are handed out to a pool of threads, and the messages for files that could not be backed
+up are printed in argument order once all copies are done.
+
+With -i a manifest remembers the size, mtime, inode and block hashes of every file backed up,
+and the size, mtime and inode its .bck was left with. A file whose statx() matches its manifest
+entry is skipped without being opened, as long as a statx() of its .bck matches too. A changed
+file is read one block at a time, and only the blocks whose XXH64 hash differs from the manifest
+are written into the existing .bck. A .bck that is missing or was changed since is copied again
+in full.
+
+With -d STORE the files are not copied at all. Each file is cut into chunks where a gear rolling
+hash hits a mask (FastCDC, with a stricter mask before the average size and a looser one after),
+so an insertion only changes the chunks around it. A chunk is saved as STORE/xx/<hash> unless a
+chunk with that hash is already there, and file.bckr lists the chunks in order. -R puts the
+files back together from their recipes. Chunks are named by two XXH64 hashes with different
+seeds, which is plenty for accidental collisions but not meant to resist crafted ones.
+
+With -z each file is written to file.bckz as independently compressed blocks. The thread backing
+up a file reads blocks and queues them for a shared set of compressor threads, then writes them
+out in order as they come back, so reading, compressing and writing overlap. The codec is an LZ4
+block compressor, and a block that does not shrink is stored as is. An index of block offsets,
+sizes and hashes follows the blocks, and the last bytes of the file say where it starts, so a
+reader can find any block without reading the ones before it. -R -z restores the files.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "stats.h"
+
+#define COPY_BUF_SIZE (1 << 20)   // Buffer for the read()/write() fallback
+#define MAX_THREADS   256
+#define SUFFIX        ".bck"
+#define HASH_BLOCK    (256 * 1024)  // Granularity of incremental rewrites
+#define MANIFEST_NAME ".bkupfiles.manifest"
+#define MANIFEST_MAGIC "BKUPMF2\n"
+#define MANIFEST_OLD   "BKUPMF1\n"       // Had no record of the .bck files
+#define RECIPE_SUFFIX ".bckr"
+#define RECIPE_MAGIC  "BKRCP1\n"
+
+// Content-defined chunk sizes
+#define CDC_MIN       2048
+#define CDC_AVG       8192
+#define CDC_MAX       65536
+#define CDC_MASK_S    0xFFFE000000000000ULL   // 15 bits: cuts are rare before CDC_AVG
+#define CDC_MASK_L    0xFFE0000000000000ULL   // 11 bits: and likely after it
+
+// Compressed backups
+#define ZIP_SUFFIX    ".bckz"
+#define ZIP_MAGIC     "BKZIP1\n"
+#define ZIP_IDX_MAGIC "BKZIDX1\n"
+#define ZIP_BLOCK     (256 * 1024)
+#define ZIP_STORED    0x80000000u      // Set in rsize for a block kept uncompressed
+#define LZ4_HASH_LOG  14
+
+// How each file was copied, or why it was not
+enum { DONE_CLONE, DONE_RANGE, DONE_RW, DONE_SPARSE, DONE_SKIP, DONE_DELTA, DONE_DEDUP, DONE_RESTORE,
+       DONE_ZIP, ERR_MISSING, ERR_ISDIR, ERR_IO };
+
+// What the manifest knows about one backed up file
+typedef struct {
+    char *path;
+    uint64_t size, ino, dev;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint64_t hash;          // Hash of the block hashes, standing for the whole file
+    uint64_t nblocks;
+    uint64_t *blocks;       // XXH64 of each HASH_BLOCK bytes
+    uint64_t bck_size, bck_ino;     // The .bck as this run left it
+    int64_t bck_mtime_sec;
+    uint32_t bck_mtime_nsec;
+} Entry;
+
+// Manifest loaded at start, looked up by path with open addressing
+typedef struct {
+    Entry **slots;
+    size_t nslots;          // Power of two
+    size_t count;
+} Manifest;
+
+// State shared by the worker threads
+typedef struct {
+    char **files;
+    int nfiles;
+    int *result;        // Outcome for each file
+    int *err;           // errno for ERR_IO
+    int *on_backup;     // ERR_IO happened on the .bck file rather than the original
+    uint64_t *logical;  // Size of each file copied
+    uint64_t *copied;   // Bytes of it actually read and written
+    Manifest *manifest; // Set for -i
+    Entry **entries;    // New manifest entry for each file with -i
+    const char *store;  // Set for -d
+    int zip;            // -z
+    int depth;          // Blocks each thread keeps in flight with -z
+    int restore;        // -R
+
+    pthread_mutex_t lock;
+    int next;           // Next file to hand out
+} Pool;
+
+// path with suffix appended, in new memory.
+static char *suffixed(const char *path, const char *suffix) {
+    size_t len = strlen(path), slen = strlen(suffix);
+    char *s = malloc(len + slen + 1);
+
+    if (s != NULL) {
+        memcpy(s, path, len);
+        memcpy(s + len, suffix, slen + 1);
+    }
+    return s;
+}
+
+// Write all len bytes, retrying short writes.
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read up to len bytes, stopping early only at end of file.
+static ssize_t read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    size_t have = 0;
+
+    while (have < len) {
+        ssize_t n = read(fd, p + have, len - have);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        have += n;
+    }
+    return have;
+}
+
+// Copy everything left in in to out with read() and write().
+static int copy_rw(int in, int out, char *buf) {
+    for (;;) {
+        ssize_t n = read(in, buf, COPY_BUF_SIZE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+        if (write_all(out, buf, n) < 0)
+            return -1;
+    }
+}
+
+// Copy len bytes at off from in to out at the same offset, in the kernel if possible.
+static int copy_extent(int in, int out, off_t off, off_t len, char *buf) {
+    off_t in_off = off, out_off = off, end = off + len;
+    int kernel = 1;
+
+    while (in_off < end) {
+        size_t want = end - in_off > COPY_BUF_SIZE ? COPY_BUF_SIZE : (size_t)(end - in_off);
+        ssize_t n;
+
+        if (kernel) {
+            n = copy_file_range(in, &in_off, out, &out_off, want, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                          errno == EOPNOTSUPP || errno == EBADF)) {
+                kernel = 0;
+                continue;
+            }
+        } else {
+            n = pread(in, buf, want, in_off);
+            if (n > 0) {
+                for (ssize_t done = 0; done < n; ) {
+                    ssize_t w = pwrite(out, buf + done, n - done, out_off + done);
+                    if (w < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        return -1;
+                    }
+                    done += w;
+                }
+                in_off += n;
+                out_off += n;
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)     // Truncated under us
+            break;
+    }
+    return 0;
+}
+
+// Copy only the data extents of a sparse file, leaving holes in out. Returns 1 if
+// the file system cannot report holes. *copied receives the bytes of data copied.
+static int copy_sparse(int in, int out, char *buf, uint64_t *copied) {
+    off_t pos = 0, end;
+
+    *copied = 0;
+    for (;;) {
+        off_t data = lseek(in, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO)     // Nothing but hole from here to the end
+                break;
+            if (pos == 0 && (errno == EINVAL || errno == EOPNOTSUPP))
+                return 1;
+            return -1;
+        }
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0)
+            return -1;
+        if (copy_extent(in, out, data, hole - data, buf) < 0)
+            return -1;
+        *copied += hole - data;
+        pos = hole;
+    }
+
+    // A trailing hole has no data to copy, so set the length explicitly
+    if ((end = lseek(in, 0, SEEK_END)) < 0 || ftruncate(out, end) < 0)
+        return -1;
+    return 0;
+}
+
+// Copy in to out inside the kernel. Returns 1 if copy_file_range() cannot be
+// used for this pair of files and nothing has been copied yet.
+static int copy_range(int in, int out, off_t size) {
+    off_t copied = 0;
+
+    for (;;) {
+        size_t want = size - copied > (1 << 30) ? (1 << 30) : (size_t)(size - copied);
+        ssize_t n = copy_file_range(in, NULL, out, NULL, want > 0 ? want : (1 << 20), 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                                errno == EOPNOTSUPP || errno == EBADF))
+                return 1;
+            return -1;
+        }
+        // Pseudo files report size 0 and may copy nothing here; read those by hand
+        if (n == 0 && copied == 0 && size == 0)
+            return 1;
+        // The file may have grown since fstat(), so stop only at end of file
+        if (n == 0)
+            return 0;
+        copied += n;
+    }
+}
+
+// XXH64, written out from the reference description
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t xxh64(const void *input, size_t len, uint64_t seed) {
+    const unsigned char *p = input;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8)
+        h = rotl64(h ^ xxh_round(0, read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        h = rotl64(h ^ (uint64_t)k * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static size_t manifest_index(const Manifest *m, const char *path) {
+    return xxh64(path, strlen(path), 0) & (m->nslots - 1);
+}
+
+static Entry *manifest_find(const Manifest *m, const char *path) {
+    if (m->nslots == 0)
+        return NULL;
+    for (size_t i = manifest_index(m, path); m->slots[i] != NULL; i = (i + 1) & (m->nslots - 1))
+        if (strcmp(m->slots[i]->path, path) == 0)
+            return m->slots[i];
+    return NULL;
+}
+
+// Add e, replacing any entry with the same path. Returns the replaced entry.
+static Entry *manifest_put(Manifest *m, Entry *e) {
+    // Keep the table at most half full
+    if (2 * (m->count + 1) > m->nslots) {
+        Manifest bigger = { calloc(m->nslots ? 2 * m->nslots : 64, sizeof(Entry *)), m->nslots ? 2 * m->nslots : 64, 0 };
+        if (bigger.slots == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < m->nslots; i++)
+            if (m->slots[i] != NULL)
+                manifest_put(&bigger, m->slots[i]);
+        free(m->slots);
+        *m = bigger;
+    }
+
+    size_t i = manifest_index(m, e->path);
+    for (; m->slots[i] != NULL; i = (i + 1) & (m->nslots - 1)) {
+        if (strcmp(m->slots[i]->path, e->path) == 0) {
+            Entry *old = m->slots[i];
+            m->slots[i] = e;
+            return old;
+        }
+    }
+    m->slots[i] = e;
+    m->count++;
+    return NULL;
+}
+
+static void free_entry(Entry *e) {
+    if (e != NULL) {
+        free(e->path);
+        free(e->blocks);
+        free(e);
+    }
+}
+
+// Fixed part of a manifest record, followed by the path and the block hashes
+typedef struct {
+    uint32_t path_len, mtime_nsec;
+    uint64_t size, ino, dev;
+    int64_t mtime_sec;
+    uint64_t hash, nblocks;
+    uint64_t bck_size, bck_ino;
+    int64_t bck_mtime_sec;
+    uint64_t bck_mtime_nsec;
+} Record;
+
+// Read the manifest at path into m. A missing manifest is empty.
+static int manifest_load(Manifest *m, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    memset(m, 0, sizeof(*m));
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Read the whole file at once and parse it in memory
+    char *data = malloc(st.st_size + 1);
+    size_t have = 0;
+    while (data != NULL && have < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + have, st.st_size - have);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        have += n;
+    }
+    close(fd);
+
+    // A manifest from before the .bck files were recorded cannot vouch for them, so it is
+    // dropped and every file is copied once in full
+    if (data != NULL && have == (size_t)st.st_size && have >= strlen(MANIFEST_OLD) &&
+        memcmp(data, MANIFEST_OLD, strlen(MANIFEST_OLD)) == 0) {
+        free(data);
+        return 0;
+    }
+    if (data == NULL || have < (size_t)st.st_size || have < strlen(MANIFEST_MAGIC) ||
+        memcmp(data, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a bkupfiles manifest, ignoring it\n", path);
+        free(data);
+        return 0;
+    }
+
+    size_t off = strlen(MANIFEST_MAGIC);
+    while (off + sizeof(Record) <= have) {
+        Record r;
+        memcpy(&r, data + off, sizeof(r));
+        off += sizeof(r);
+        if (r.nblocks > (have - off) / sizeof(uint64_t) || r.path_len > have - off - r.nblocks * sizeof(uint64_t))
+            break;      // Truncated; keep what was read so far
+
+        Entry *e = calloc(1, sizeof(Entry));
+        if (e == NULL || (e->path = malloc(r.path_len + 1)) == NULL ||
+            (e->blocks = malloc(r.nblocks * sizeof(uint64_t) + 1)) == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(e->path, data + off, r.path_len);
+        e->path[r.path_len] = '\0';
+        off += r.path_len;
+        memcpy(e->blocks, data + off, r.nblocks * sizeof(uint64_t));
+        off += r.nblocks * sizeof(uint64_t);
+
+        e->size = r.size;
+        e->ino = r.ino;
+        e->dev = r.dev;
+        e->mtime_sec = r.mtime_sec;
+        e->mtime_nsec = r.mtime_nsec;
+        e->hash = r.hash;
+        e->nblocks = r.nblocks;
+        e->bck_size = r.bck_size;
+        e->bck_ino = r.bck_ino;
+        e->bck_mtime_sec = r.bck_mtime_sec;
+        e->bck_mtime_nsec = (uint32_t)r.bck_mtime_nsec;
+        free_entry(manifest_put(m, e));
+    }
+
+    free(data);
+    return 0;
+}
+
+// Write m to path through a temporary file, so a crash leaves the old manifest.
+static int manifest_save(const Manifest *m, const char *path) {
+    size_t len = strlen(path);
+    char *tmp = malloc(len + 5);
+    FILE *fp;
+
+    if (tmp == NULL)
+        return -1;
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        free(tmp);
+        return -1;
+    }
+    fwrite(MANIFEST_MAGIC, 1, strlen(MANIFEST_MAGIC), fp);
+    for (size_t i = 0; i < m->nslots; i++) {
+        Entry *e = m->slots[i];
+        if (e == NULL)
+            continue;
+        Record r = { (uint32_t)strlen(e->path), e->mtime_nsec, e->size, e->ino, e->dev,
+                     e->mtime_sec, e->hash, e->nblocks, e->bck_size, e->bck_ino,
+                     e->bck_mtime_sec, e->bck_mtime_nsec };
+        fwrite(&r, sizeof(r), 1, fp);
+        fwrite(e->path, 1, r.path_len, fp);
+        fwrite(e->blocks, sizeof(uint64_t), e->nblocks, fp);
+    }
+
+    int rc = (ferror(fp) | fclose(fp)) ? -1 : rename(tmp, path);
+    if (rc < 0)
+        unlink(tmp);
+    free(tmp);
+    return rc;
+}
+
+// Start a new manifest entry for path from its statx() results.
+static Entry *new_entry(const char *path, const struct statx *stx) {
+    Entry *e = calloc(1, sizeof(Entry));
+
+    if (e == NULL || (e->path = strdup(path)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    e->size = stx->stx_size;
+    e->ino = stx->stx_ino;
+    e->dev = ((uint64_t)stx->stx_dev_major << 32) | stx->stx_dev_minor;
+    e->mtime_sec = stx->stx_mtime.tv_sec;
+    e->mtime_nsec = stx->stx_mtime.tv_nsec;
+    e->nblocks = (e->size + HASH_BLOCK - 1) / HASH_BLOCK;
+    e->blocks = malloc(e->nblocks * sizeof(uint64_t) + 1);
+    if (e->blocks == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return e;
+}
+
+// Record in e the size, inode and mtime of the .bck at dst. One that cannot be read is left
+// recorded as nothing, so the next run copies the file in full.
+static void note_backup(Entry *e, const char *dst) {
+    struct statx stx;
+
+    e->bck_size = e->bck_ino = 0;
+    e->bck_mtime_sec = 0;
+    e->bck_mtime_nsec = 0;
+    if (dst != NULL && statx(AT_FDCWD, dst, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &stx) == 0 &&
+        S_ISREG(stx.stx_mode)) {
+        e->bck_size = stx.stx_size;
+        e->bck_ino = stx.stx_ino;
+        e->bck_mtime_sec = stx.stx_mtime.tv_sec;
+        e->bck_mtime_nsec = stx.stx_mtime.tv_nsec;
+    }
+}
+
+// Whether the .bck at dst is still the one old says an earlier run left
+static int backup_intact(const Entry *old, const char *dst) {
+    Entry now;
+
+    if (old == NULL || old->bck_ino == 0)
+        return 0;
+    note_backup(&now, dst);
+    return now.bck_ino == old->bck_ino && now.bck_size == old->bck_size &&
+           now.bck_mtime_sec == old->bck_mtime_sec && now.bck_mtime_nsec == old->bck_mtime_nsec;
+}
+
+// Read block i of fd into buf. Returns its length, or -1.
+static ssize_t read_block(int fd, char *buf, uint64_t i, uint64_t size) {
+    size_t want = size - i * HASH_BLOCK < HASH_BLOCK ? size - i * HASH_BLOCK : HASH_BLOCK;
+    size_t have = 0;
+
+    while (have < want) {
+        ssize_t n = pread(fd, buf + have, want - have, i * HASH_BLOCK + have);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;  // Shrunk while reading; the next run will see a new mtime
+        have += n;
+    }
+    return have;
+}
+
+// Hash the blocks of in for e. If out is given, blocks whose hash differs
+// from old are also written to out at the same offset.
+static int hash_blocks(int in, int out, Entry *e, const Entry *old, char *buf, uint64_t *written) {
+    for (uint64_t i = 0; i < e->nblocks; i++) {
+        ssize_t n = read_block(in, buf, i, e->size);
+        if (n < 0)
+            return -1;
+        e->blocks[i] = xxh64(buf, n, 0);
+
+        if (out >= 0 && (i >= old->nblocks || e->blocks[i] != old->blocks[i])) {
+            for (ssize_t done = 0; done < n; ) {
+                ssize_t w = pwrite(out, buf + done, n - done, i * HASH_BLOCK + done);
+                if (w < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return -1;
+                }
+                done += w;
+            }
+            if (written != NULL)
+                *written += n;
+        }
+    }
+    e->hash = xxh64(e->blocks, e->nblocks * sizeof(uint64_t), e->size);
+    return 0;
+}
+
+// Back up one file. buf is this thread's fallback buffer.
+static int backup_file(const char *path, char *buf, int *on_backup, uint64_t *logical, uint64_t *copied) {
+    struct stat st;
+    char *dst = suffixed(path, SUFFIX);
+    int in, out, how, rc;
+
+    *on_backup = 0;
+    *logical = *copied = 0;
+    if (dst == NULL)
+        return ERR_IO;
+
+    if ((in = open(path, O_RDONLY)) < 0) {
+        free(dst);
+        return errno == ENOENT ? ERR_MISSING : ERR_IO;
+    }
+    if (fstat(in, &st) < 0) {
+        close(in);
+        free(dst);
+        return ERR_IO;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        close(in);
+        free(dst);
+        return ERR_ISDIR;
+    }
+
+    // Like cp -f, remove a backup that cannot be opened for writing and try again
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (out < 0 && errno != ENOENT && unlink(dst) == 0)
+        out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (out < 0) {
+        *on_backup = 1;
+        close(in);
+        free(dst);
+        return ERR_IO;
+    }
+
+    // Cheapest first: share the blocks, copy only the data, copy in the kernel, copy by hand
+    *logical = st.st_size;
+    if (S_ISREG(st.st_mode) && ioctl(out, FICLONE, in) == 0) {
+        how = DONE_CLONE;
+        rc = 0;
+    } else if (S_ISREG(st.st_mode) && (uint64_t)st.st_blocks * 512 < (uint64_t)st.st_size &&
+               (rc = copy_sparse(in, out, buf, copied)) != 1) {
+        how = DONE_SPARSE;
+    } else if (S_ISREG(st.st_mode) && (rc = copy_range(in, out, st.st_size)) != 1) {
+        how = DONE_RANGE;
+    } else {
+        how = DONE_RW;
+        rc = copy_rw(in, out, buf);
+    }
+    if (how == DONE_RANGE || how == DONE_RW) {
+        off_t end = lseek(out, 0, SEEK_CUR);
+        *logical = *copied = end > 0 ? (uint64_t)end : 0;
+    }
+
+    int saved = errno;
+    if (close(out) < 0 && rc == 0) {
+        rc = -1;
+        saved = errno;
+    }
+    close(in);
+    free(dst);
+    errno = saved;
+    return rc < 0 ? ERR_IO : how;
+}
+
+// Back up one file with -i. *out receives its new manifest entry on success, and *logical and
+// *copied its size and the bytes written to its backup, as backup_file() gives them.
+static int backup_incremental(const char *path, char *buf, int *on_backup, const Manifest *m, Entry **out,
+                              uint64_t *logical, uint64_t *copied) {
+    struct statx stx;
+    const Entry *old;
+
+    *on_backup = 0;
+    *out = NULL;
+    *logical = *copied = 0;
+
+    // One statx() decides whether an unchanged file can be skipped
+    if (statx(AT_FDCWD, path, 0, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &stx) < 0)
+        return errno == ENOENT ? ERR_MISSING : ERR_IO;
+    if (S_ISDIR(stx.stx_mode))
+        return ERR_ISDIR;
+
+    // and a second, of the .bck, whether the backup it would be skipped for is still there
+    old = manifest_find(m, path);
+    char *dst = suffixed(path, SUFFIX);
+    int intact = dst != NULL && backup_intact(old, dst);
+    Entry *e = new_entry(path, &stx);
+    if (intact && old->size == e->size && old->ino == e->ino && old->dev == e->dev &&
+        old->mtime_sec == e->mtime_sec && old->mtime_nsec == e->mtime_nsec) {
+        memcpy(e->blocks, old->blocks, e->nblocks * sizeof(uint64_t));
+        e->hash = old->hash;
+        e->bck_size = old->bck_size;
+        e->bck_ino = old->bck_ino;
+        e->bck_mtime_sec = old->bck_mtime_sec;
+        e->bck_mtime_nsec = old->bck_mtime_nsec;
+        free(dst);
+        *out = e;
+        *logical = e->size;
+        return DONE_SKIP;
+    }
+
+    int in = open(path, O_RDONLY);
+    if (in < 0) {
+        free(dst);
+        free_entry(e);
+        return ERR_IO;
+    }
+
+    // A changed file whose backup is still the version in the manifest gets only its changed blocks rewritten
+    if (intact && S_ISREG(stx.stx_mode)) {
+        int fd = open(dst, O_RDWR);
+        if (fd >= 0) {
+            int rc = hash_blocks(in, fd, e, old, buf, copied);
+            if (rc == 0 && ftruncate(fd, e->size) < 0)
+                rc = -1;
+            if (rc < 0)
+                *on_backup = 1;
+            int saved = errno;
+            if (close(fd) < 0 && rc == 0) {
+                rc = -1;
+                saved = errno;
+                *on_backup = 1;
+            }
+            close(in);
+            if (rc == 0)
+                note_backup(e, dst);
+            free(dst);
+            errno = saved;
+            if (rc < 0) {
+                free_entry(e);
+                return ERR_IO;
+            }
+            *out = e;
+            *logical = e->size;
+            return DONE_DELTA;
+        }
+    }
+
+    // Otherwise copy the whole file the usual way, then hash it for next time
+    close(in);
+    int how = backup_file(path, buf, on_backup, logical, copied);
+    if (how == ERR_IO || how == ERR_MISSING || how == ERR_ISDIR) {
+        free(dst);
+        free_entry(e);
+        return how;
+    }
+    note_backup(e, dst);
+    free(dst);
+    if ((in = open(path, O_RDONLY)) < 0 || hash_blocks(in, -1, e, NULL, buf, NULL) < 0) {
+        int saved = errno;
+        if (in >= 0)
+            close(in);
+        free_entry(e);
+        errno = saved;
+        return ERR_IO;
+    }
+    close(in);
+    *out = e;
+    return how;
+}
+
+// Gear table for the rolling hash. Filled from a fixed seed so cut points never change between runs.
+static uint64_t gear[256];
+
+static void gear_init(void) {
+    uint64_t x = 0x62b6c1e1d3a5f097ULL;
+
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the chunk at the start of p[0..n). The whole of p is used only at end of file.
+static size_t cdc_cut(const unsigned char *p, size_t n) {
+    size_t i = CDC_MIN, normal = CDC_AVG;
+    uint64_t fp = 0;
+
+    if (n <= CDC_MIN)
+        return n;
+    if (n > CDC_MAX)
+        n = CDC_MAX;
+    if (n < normal)
+        normal = n;
+
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if (!(fp & CDC_MASK_S))
+            return i;
+    }
+    for (; i < n; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if (!(fp & CDC_MASK_L))
+            return i;
+    }
+    return n;
+}
+
+// One chunk in a recipe
+typedef struct {
+    uint64_t hash[2];
+    uint32_t len;
+    uint32_t unused;
+} ChunkRef;
+
+// Fixed start of a recipe, followed by nchunks ChunkRefs
+typedef struct {
+    char magic[8];
+    uint64_t size;
+    uint32_t mode;
+    uint32_t unused;
+    uint64_t nchunks;
+} RecipeHeader;
+
+// STORE/xx/<32 hex digits> for a chunk hash
+static char *chunk_path(const char *store, const uint64_t hash[2]) {
+    size_t len = strlen(store);
+    char *path = malloc(len + 40);
+
+    if (path != NULL)
+        sprintf(path, "%s/%02x/%016llx%016llx", store, (unsigned)(hash[0] >> 56),
+                (unsigned long long)hash[0], (unsigned long long)hash[1]);
+    return path;
+}
+
+// Save a chunk unless the store already has it.
+static int store_chunk(const char *store, const ChunkRef *ref, const unsigned char *data) {
+    char *path = chunk_path(store, ref->hash);
+    struct stat st;
+    int rc = 0;
+
+    if (path == NULL)
+        return -1;
+    if (stat(path, &st) == 0) {
+        free(path);
+        return 0;
+    }
+
+    // Write under a name private to this thread, then rename, so a chunk is complete or absent
+    char *tmp = malloc(strlen(path) + 32);
+    if (tmp == NULL) {
+        free(path);
+        return -1;
+    }
+    sprintf(tmp, "%s.%ld.%lx.tmp", path, (long)getpid(), (unsigned long)pthread_self());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+    if (fd < 0 || write_all(fd, data, ref->len) < 0)
+        rc = -1;
+    if (fd >= 0 && close(fd) < 0)
+        rc = -1;
+    if (rc == 0 && rename(tmp, path) < 0)
+        rc = -1;
+    if (rc < 0)
+        unlink(tmp);
+
+    free(tmp);
+    free(path);
+    return rc;
+}
+
+// Write the recipe for path through a temporary file.
+static int write_recipe(const char *path, const RecipeHeader *hdr, const ChunkRef *refs) {
+    char *dst = suffixed(path, RECIPE_SUFFIX);
+    char *tmp = suffixed(path, RECIPE_SUFFIX ".tmp");
+    int rc = -1;
+
+    if (dst != NULL && tmp != NULL) {
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd >= 0) {
+            rc = write_all(fd, hdr, sizeof(*hdr));
+            if (rc == 0)
+                rc = write_all(fd, refs, hdr->nchunks * sizeof(ChunkRef));
+            if (close(fd) < 0)
+                rc = -1;
+            if (rc == 0)
+                rc = rename(tmp, dst);
+            if (rc < 0)
+                unlink(tmp);
+        }
+    }
+    free(dst);
+    free(tmp);
+    return rc;
+}
+
+// Back up one file into the chunk store with -d. buf holds at least COPY_BUF_SIZE bytes.
+static int backup_dedup(const char *path, unsigned char *buf, int *on_backup, const char *store) {
+    struct stat st;
+    RecipeHeader hdr;
+    ChunkRef *refs = NULL;
+    size_t cap = 0, have = 0;
+    int eof = 0, rc = 0;
+
+    *on_backup = 0;
+    int in = open(path, O_RDONLY);
+    if (in < 0)
+        return errno == ENOENT ? ERR_MISSING : ERR_IO;
+    if (fstat(in, &st) < 0) {
+        close(in);
+        return ERR_IO;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        close(in);
+        return ERR_ISDIR;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RECIPE_MAGIC, sizeof(RECIPE_MAGIC));
+    hdr.mode = st.st_mode & 07777;
+
+    // Keep at least one maximum chunk in the buffer until end of file
+    while (rc == 0) {
+        if (!eof && have < CDC_MAX) {
+            ssize_t n = read_full(in, buf + have, COPY_BUF_SIZE - have);
+            if (n < 0) {
+                rc = -1;
+                break;
+            }
+            eof = (size_t)n < COPY_BUF_SIZE - have;
+            have += n;
+        }
+        if (have == 0)
+            break;
+
+        size_t off = 0;
+        while (rc == 0 && (have - off >= CDC_MAX || (eof && off < have))) {
+            if (hdr.nchunks == cap) {
+                cap = cap ? 2 * cap : 64;
+                ChunkRef *grown = realloc(refs, cap * sizeof(ChunkRef));
+                if (grown == NULL) {
+                    rc = -1;
+                    break;
+                }
+                refs = grown;
+            }
+
+            ChunkRef *ref = &refs[hdr.nchunks++];
+            memset(ref, 0, sizeof(*ref));
+            ref->len = cdc_cut(buf + off, have - off);
+            ref->hash[0] = xxh64(buf + off, ref->len, 0);
+            ref->hash[1] = xxh64(buf + off, ref->len, 0x5bd1e995);
+            if (store_chunk(store, ref, buf + off) < 0) {
+                *on_backup = 1;
+                rc = -1;
+            }
+            off += ref->len;
+            hdr.size += ref->len;
+        }
+        memmove(buf, buf + off, have - off);
+        have -= off;
+    }
+
+    int saved = errno;
+    close(in);
+    if (rc == 0 && write_recipe(path, &hdr, refs) < 0) {
+        saved = errno;
+        *on_backup = 1;
+        rc = -1;
+    }
+    free(refs);
+    errno = saved;
+    return rc < 0 ? ERR_IO : DONE_DEDUP;
+}
+
+// Rebuild path from its recipe and the chunk store with -R.
+static int restore_dedup(const char *path, unsigned char *buf, int *on_backup, const char *store) {
+    char *recipe = suffixed(path, RECIPE_SUFFIX);
+    char *tmp = suffixed(path, ".restore.tmp");
+    RecipeHeader hdr;
+    int rc = -1, out = -1;
+
+    *on_backup = 1;
+    int in = recipe != NULL ? open(recipe, O_RDONLY) : -1;
+    if (in < 0) {
+        int missing = errno == ENOENT;
+        free(recipe);
+        free(tmp);
+        return missing ? ERR_MISSING : ERR_IO;
+    }
+
+    if (tmp == NULL || read_full(in, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, RECIPE_MAGIC, sizeof(RECIPE_MAGIC)) != 0) {
+        errno = EBADMSG;
+        goto done;
+    }
+
+    if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, hdr.mode)) < 0)
+        goto done;
+
+    for (uint64_t i = 0; i < hdr.nchunks; i++) {
+        ChunkRef ref;
+        if (read_full(in, &ref, sizeof(ref)) != sizeof(ref) || ref.len > CDC_MAX) {
+            errno = EBADMSG;
+            goto done;
+        }
+
+        // Check every chunk against its name before using it
+        char *cpath = chunk_path(store, ref.hash);
+        int cfd = cpath != NULL ? open(cpath, O_RDONLY) : -1;
+        free(cpath);
+        if (cfd < 0)
+            goto done;
+        ssize_t n = read_full(cfd, buf, ref.len + 1);   // One extra byte catches a chunk that grew
+        close(cfd);
+        if (n != (ssize_t)ref.len || xxh64(buf, n, 0) != ref.hash[0] ||
+            xxh64(buf, n, 0x5bd1e995) != ref.hash[1]) {
+            errno = EBADMSG;
+            goto done;
+        }
+        if (write_all(out, buf, n) < 0) {
+            *on_backup = 0;
+            goto done;
+        }
+    }
+
+    *on_backup = 0;
+    if (close(out) < 0) {
+        out = -1;
+        goto done;
+    }
+    out = -1;
+    rc = rename(tmp, path);
+
+done:
+    {
+        int saved = errno;
+        if (out >= 0)
+            close(out);
+        if (rc < 0 && tmp != NULL)
+            unlink(tmp);
+        close(in);
+        free(recipe);
+        free(tmp);
+        errno = saved;
+    }
+    return rc < 0 ? ERR_IO : DONE_RESTORE;
+}
+
+// Create the store and its 256 fan-out directories.
+static int make_store(const char *store) {
+    char *path = malloc(strlen(store) + 4);
+
+    if (path == NULL || (mkdir(store, 0777) < 0 && errno != EEXIST)) {
+        free(path);
+        return -1;
+    }
+    for (int i = 0; i < 256; i++) {
+        sprintf(path, "%s/%02x", store, i);
+        if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+            free(path);
+            return -1;
+        }
+    }
+    free(path);
+    return 0;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Emit an LZ4 length continuation for the part of len past 15.
+static unsigned char *lz4_len(unsigned char *op, size_t len) {
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Compress src into LZ4 block format. Returns the size, or -1 if it does not fit in cap.
+static long lz4_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap,
+                         uint32_t *table) {
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+    if (n >= 13) {
+        // The format wants the last match to start 12 bytes and end 5 bytes before the end
+        const unsigned char *mflimit = end - 12, *matchlimit = end - 5;
+        for (ip++; ip < mflimit; ) {
+            uint32_t seq = read32(ip), h = lz4_hash(seq);
+            const unsigned char *ref = src + table[h];
+            table[h] = ip - src;
+            if (ip - ref > 65535 || read32(ref) != seq) {
+                ip += 1 + ((ip - anchor) >> 6);     // Skip faster through data that does not match
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *mp = ip + 4, *rp = ref + 4;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t lit = ip - anchor, mlen = mp - ip - 4;
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1)
+                return -1;
+            unsigned char *token = op++;
+            *token = lit >= 15 ? 15 << 4 : lit << 4;
+            if (lit >= 15)
+                op = lz4_len(op, lit);
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = (unsigned char)(ip - ref);
+            *op++ = (unsigned char)((ip - ref) >> 8);
+            *token |= mlen >= 15 ? 15 : mlen;
+            if (mlen >= 15)
+                op = lz4_len(op, mlen);
+
+            ip = anchor = mp;
+            if (ip < mflimit)
+                table[lz4_hash(read32(ip - 2))] = ip - 2 - src;
+        }
+    }
+
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+        return -1;
+    *op = lit >= 15 ? 15 << 4 : lit << 4;
+    op = lit >= 15 ? lz4_len(op + 1, lit) : op + 1;
+    memcpy(op, anchor, lit);
+    return op + lit - dst;
+}
+
+// Decompress an LZ4 block into dst. Returns the size, or -1 for a damaged block.
+static long lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, mlen = token & 15;
+        unsigned char b;
+
+        if (lit == 15)
+            do {
+                if (ip >= iend)
+                    return -1;
+                lit += b = *ip++;
+            } while (b == 255);
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst))
+            return -1;
+        if (mlen == 15)
+            do {
+                if (ip >= iend)
+                    return -1;
+                mlen += b = *ip++;
+            } while (b == 255);
+        mlen += 4;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+        for (const unsigned char *from = op - off; mlen > 0; mlen--)   // Matches may overlap
+            *op++ = *from++;
+    }
+    return op - dst;
+}
+
+// One block on its way through the compressors
+typedef struct ZBlock {
+    unsigned char *raw, *packed;
+    uint32_t rsize, csize;
+    uint64_t hash;
+    int done;
+    struct ZBlock *next;
+} ZBlock;
+
+// Blocks waiting for a compressor, shared by every thread backing up a file
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    ZBlock *head, *tail;
+    int stop;
+} zq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+static void zq_push(ZBlock *b) {
+    pthread_mutex_lock(&zq.lock);
+    b->done = 0;
+    b->next = NULL;
+    if (zq.tail != NULL)
+        zq.tail->next = b;
+    else
+        zq.head = b;
+    zq.tail = b;
+    pthread_cond_signal(&zq.work);
+    pthread_mutex_unlock(&zq.lock);
+}
+
+static void zq_wait(ZBlock *b) {
+    pthread_mutex_lock(&zq.lock);
+    while (!b->done)
+        pthread_cond_wait(&zq.done, &zq.lock);
+    pthread_mutex_unlock(&zq.lock);
+}
+
+static void *compressor_main(void *arg) {
+    uint32_t *table = malloc(sizeof(uint32_t) << LZ4_HASH_LOG);
+
+    (void)arg;
+    if (table == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&zq.lock);
+        while (zq.head == NULL && !zq.stop)
+            pthread_cond_wait(&zq.work, &zq.lock);
+        ZBlock *b = zq.head;
+        if (b == NULL) {
+            pthread_mutex_unlock(&zq.lock);
+            break;
+        }
+        if ((zq.head = b->next) == NULL)
+            zq.tail = NULL;
+        pthread_mutex_unlock(&zq.lock);
+
+        b->hash = xxh64(b->raw, b->rsize, 0);
+        long c = lz4_compress(b->raw, b->rsize, b->packed, b->rsize - 1, table);
+        b->csize = c < 0 ? b->rsize : (uint32_t)c;
+
+        pthread_mutex_lock(&zq.lock);
+        b->done = 1;
+        pthread_cond_broadcast(&zq.done);
+        pthread_mutex_unlock(&zq.lock);
+    }
+
+    free(table);
+    return NULL;
+}
+
+// Start of a .bckz file
+typedef struct {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t mode;
+} ZipHeader;
+
+// Index entry for one block
+typedef struct {
+    uint64_t offset;
+    uint64_t hash;          // XXH64 of the uncompressed block
+    uint32_t csize;
+    uint32_t rsize;         // ZIP_STORED set if the block is not compressed
+} ZipIndex;
+
+// End of a .bckz file, after the index
+typedef struct {
+    uint64_t nblocks;
+    uint64_t size;
+    char magic[8];
+} ZipFooter;
+
+// Back up one file as file.bckz with -z, keeping depth blocks in flight.
+static int backup_compressed(const char *path, int *on_backup, int depth) {
+    struct stat st;
+    ZipHeader hdr;
+    ZipFooter foot;
+    ZipIndex *index = NULL;
+    size_t cap = 0;
+    uint64_t offset = sizeof(hdr);
+    int rc = 0, saved = 0;
+
+    *on_backup = 0;
+    int in = open(path, O_RDONLY);
+    if (in < 0)
+        return errno == ENOENT ? ERR_MISSING : ERR_IO;
+    if (fstat(in, &st) < 0) {
+        close(in);
+        return ERR_IO;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        close(in);
+        return ERR_ISDIR;
+    }
+
+    char *dst = suffixed(path, ZIP_SUFFIX);
+    int out = dst != NULL ? open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+    free(dst);
+    ZBlock *ring = calloc(depth, sizeof(ZBlock));
+    unsigned char *mem = malloc((size_t)depth * 2 * ZIP_BLOCK);
+    if (out < 0 || ring == NULL || mem == NULL) {
+        saved = errno;
+        *on_backup = out < 0;
+        if (out >= 0)
+            close(out);
+        close(in);
+        free(ring);
+        free(mem);
+        errno = saved;
+        return ERR_IO;
+    }
+    for (int i = 0; i < depth; i++) {
+        ring[i].raw = mem + (size_t)i * 2 * ZIP_BLOCK;
+        ring[i].packed = ring[i].raw + ZIP_BLOCK;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ZIP_MAGIC, sizeof(ZIP_MAGIC));
+    hdr.block_size = ZIP_BLOCK;
+    hdr.mode = st.st_mode & 07777;
+    memset(&foot, 0, sizeof(foot));
+    memcpy(foot.magic, ZIP_IDX_MAGIC, sizeof(foot.magic));
+    if (write_all(out, &hdr, sizeof(hdr)) < 0) {
+        saved = errno;
+        *on_backup = 1;
+        rc = -1;
+    }
+
+    // Keep the ring full of reads while writing finished blocks in order
+    int head = 0, filled = 0, eof = 0;
+    while (filled > 0 || (!eof && rc == 0)) {
+        while (!eof && rc == 0 && filled < depth) {
+            ZBlock *b = &ring[(head + filled) % depth];
+            ssize_t n = read_full(in, b->raw, ZIP_BLOCK);
+            if (n < 0) {
+                saved = errno;
+                rc = -1;
+                break;
+            }
+            eof = n < ZIP_BLOCK;
+            if (n == 0)
+                break;
+            b->rsize = n;
+            zq_push(b);
+            filled++;
+        }
+        if (filled == 0)
+            break;
+
+        // A failed file still waits for its blocks so the ring can be freed
+        ZBlock *b = &ring[head];
+        zq_wait(b);
+        head = (head + 1) % depth;
+        filled--;
+        if (rc < 0)
+            continue;
+
+        if (foot.nblocks == cap) {
+            cap = cap ? 2 * cap : 64;
+            ZipIndex *grown = realloc(index, cap * sizeof(ZipIndex));
+            if (grown == NULL) {
+                saved = errno;
+                rc = -1;
+                continue;
+            }
+            index = grown;
+        }
+        int stored = b->csize == b->rsize;
+        ZipIndex *e = &index[foot.nblocks++];
+        e->offset = offset;
+        e->hash = b->hash;
+        e->csize = b->csize;
+        e->rsize = b->rsize | (stored ? ZIP_STORED : 0);
+        if (write_all(out, stored ? b->raw : b->packed, b->csize) < 0) {
+            saved = errno;
+            *on_backup = 1;
+            rc = -1;
+        }
+        offset += b->csize;
+        foot.size += b->rsize;
+    }
+
+    if (rc == 0 && (write_all(out, index, foot.nblocks * sizeof(ZipIndex)) < 0 ||
+                    write_all(out, &foot, sizeof(foot)) < 0)) {
+        saved = errno;
+        *on_backup = 1;
+        rc = -1;
+    }
+    if (close(out) < 0 && rc == 0) {
+        saved = errno;
+        *on_backup = 1;
+        rc = -1;
+    }
+    close(in);
+    free(index);
+    free(ring);
+    free(mem);
+    errno = saved;
+    return rc < 0 ? ERR_IO : DONE_ZIP;
+}
+
+// Rebuild path from path.bckz with -R -z. buf holds at least 2 * ZIP_BLOCK bytes.
+static int restore_compressed(const char *path, unsigned char *buf, int *on_backup) {
+    char *src = suffixed(path, ZIP_SUFFIX);
+    char *tmp = suffixed(path, ".restore.tmp");
+    ZipHeader hdr;
+    ZipFooter foot;
+    ZipIndex *index = NULL;
+    struct stat st;
+    int rc = -1, out = -1;
+
+    *on_backup = 1;
+    int in = src != NULL ? open(src, O_RDONLY) : -1;
+    if (in < 0) {
+        int missing = errno == ENOENT;
+        free(src);
+        free(tmp);
+        return missing ? ERR_MISSING : ERR_IO;
+    }
+
+    // Find the index through the footer, then check it covers exactly the blocks
+    errno = EBADMSG;
+    if (tmp == NULL || fstat(in, &st) < 0 || st.st_size < (off_t)(sizeof(hdr) + sizeof(foot)) ||
+        pread(in, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        pread(in, &foot, sizeof(foot), st.st_size - sizeof(foot)) != sizeof(foot) ||
+        memcmp(hdr.magic, ZIP_MAGIC, sizeof(ZIP_MAGIC)) != 0 ||
+        memcmp(foot.magic, ZIP_IDX_MAGIC, sizeof(foot.magic)) != 0 || hdr.block_size > ZIP_BLOCK ||
+        foot.nblocks > (uint64_t)(st.st_size - sizeof(hdr) - sizeof(foot)) / sizeof(ZipIndex))
+        goto done;
+    size_t ilen = foot.nblocks * sizeof(ZipIndex);
+    off_t ioff = st.st_size - sizeof(foot) - ilen;
+    if ((index = malloc(ilen + 1)) == NULL || pread(in, index, ilen, ioff) != (ssize_t)ilen) {
+        errno = index == NULL ? ENOMEM : EBADMSG;
+        goto done;
+    }
+
+    if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, hdr.mode)) < 0)
+        goto done;
+
+    unsigned char *packed = buf, *raw = buf + ZIP_BLOCK;
+    for (uint64_t i = 0; i < foot.nblocks; i++) {
+        ZipIndex *e = &index[i];
+        uint32_t rsize = e->rsize & ~ZIP_STORED;
+        if (e->csize > hdr.block_size || rsize > hdr.block_size ||
+            e->offset + e->csize > (uint64_t)ioff ||
+            pread(in, packed, e->csize, e->offset) != (ssize_t)e->csize) {
+            errno = EBADMSG;
+            goto done;
+        }
+        if (e->rsize & ZIP_STORED)
+            memcpy(raw, packed, e->csize);
+        else if (lz4_decompress(packed, e->csize, raw, hdr.block_size) != rsize) {
+            errno = EBADMSG;
+            goto done;
+        }
+        if ((e->rsize & ZIP_STORED && e->csize != rsize) || xxh64(raw, rsize, 0) != e->hash) {
+            errno = EBADMSG;
+            goto done;
+        }
+        if (write_all(out, raw, rsize) < 0) {
+            *on_backup = 0;
+            goto done;
+        }
+    }
+
+    *on_backup = 0;
+    if (close(out) < 0) {
+        out = -1;
+        goto done;
+    }
+    out = -1;
+    rc = rename(tmp, path);
+
+done:
+    {
+        int saved = errno;
+        if (out >= 0)
+            close(out);
+        if (rc < 0 && tmp != NULL)
+            unlink(tmp);
+        close(in);
+        free(index);
+        free(src);
+        free(tmp);
+        errno = saved;
+    }
+    return rc < 0 ? ERR_IO : DONE_RESTORE;
+}
+
+static void *worker_main(void *arg) {
+    Pool *pool = arg;
+    char *buf = malloc(COPY_BUF_SIZE > HASH_BLOCK ? COPY_BUF_SIZE : HASH_BLOCK);
+
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (i >= pool->nfiles)
+            break;
+
+        if (pool->zip && pool->restore)
+            pool->result[i] = restore_compressed(pool->files[i], (unsigned char *)buf,
+                                                 &pool->on_backup[i]);
+        else if (pool->zip)
+            pool->result[i] = backup_compressed(pool->files[i], &pool->on_backup[i], pool->depth);
+        else if (pool->store != NULL && pool->restore)
+            pool->result[i] = restore_dedup(pool->files[i], (unsigned char *)buf,
+                                            &pool->on_backup[i], pool->store);
+        else if (pool->store != NULL)
+            pool->result[i] = backup_dedup(pool->files[i], (unsigned char *)buf,
+                                           &pool->on_backup[i], pool->store);
+        else if (pool->manifest != NULL)
+            pool->result[i] = backup_incremental(pool->files[i], buf, &pool->on_backup[i],
+                                                 pool->manifest, &pool->entries[i], &pool->logical[i],
+                                                 &pool->copied[i]);
+        else
+            pool->result[i] = backup_file(pool->files[i], buf, &pool->on_backup[i],
+                                          &pool->logical[i], &pool->copied[i]);
+        pool->err[i] = errno;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu > 0 ? (ncpu < MAX_THREADS ? (int)ncpu : MAX_THREADS) : 1;
+    int opt;
+    int opt_i = 0;
+    int opt_R = 0;
+    int opt_z = 0;
+    int opt_v = 0;
+    const char *manifest_path = MANIFEST_NAME;
+    const char *store = NULL;
+
+    stats_init(&argc, argv);
+    stats_phase("setup");
+
+    while ((opt = getopt(argc, argv, "j:vim:d:Rz")) != -1) {
+        switch (opt) {
+            case 'j':
+                nthreads = atoi(optarg);
+                if (nthreads < 1 || nthreads > MAX_THREADS) {
+                    fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'v':
+                opt_v++;
+                break;
+            case 'i':
+                opt_i++;
+                break;
+            case 'm':
+                manifest_path = optarg;
+                opt_i++;
+                break;
+            case 'd':
+                store = optarg;
+                break;
+            case 'R':
+                opt_R++;
+                break;
+            case 'z':
+                opt_z++;
+                break;
+            default:
+                fprintf(stderr, "bkupfiles [-j threads] [-v] [-i] [-m manifest] [-d store | -z] [-R] [--stats] [file1] [file2] [file3] ... [fileN]\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // Check if at least one argument is provided
+    if (optind >= argc) {
+        printf("No arguments.\n");
+        printf("bkupfiles [-j threads] [-v] [-i] [-m manifest] [-d store | -z] [-R] [--stats] [file1] [file2] [file3] ... [fileN]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The chunk store and compressed backups replace .bck copies, so they do not mix with -i
+    if ((opt_R && store == NULL && !opt_z) || (store != NULL && opt_z) || ((store != NULL || opt_z) && opt_i)) {
+        fprintf(stderr, "-R needs -d or -z, and -d, -z and -i cannot be combined.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (store != NULL) {
+        if (make_store(store) < 0) {
+            perror(store);
+            exit(EXIT_FAILURE);
+        }
+        gear_init();
+    }
+
+    Pool pool;
+    Manifest manifest;
+    pool.manifest = NULL;
+    pool.entries = NULL;
+    pool.store = store;
+    pool.zip = opt_z;
+    pool.restore = opt_R;
+    if (opt_i) {
+        if (manifest_load(&manifest, manifest_path) < 0) {
+            perror(manifest_path);
+            exit(EXIT_FAILURE);
+        }
+        pool.manifest = &manifest;
+    }
+
+    pool.files = argv + optind;
+    pool.nfiles = argc - optind;
+    pool.next = 0;
+    pool.result = calloc(pool.nfiles, sizeof(int));
+    pool.err = calloc(pool.nfiles, sizeof(int));
+    pool.on_backup = calloc(pool.nfiles, sizeof(int));
+    pool.logical = calloc(pool.nfiles, sizeof(uint64_t));
+    pool.copied = calloc(pool.nfiles, sizeof(uint64_t));
+    if (opt_i)
+        pool.entries = calloc(pool.nfiles, sizeof(Entry *));
+    if (pool.result == NULL || pool.err == NULL || pool.on_backup == NULL ||
+        pool.logical == NULL || pool.copied == NULL || (opt_i && pool.entries == NULL)) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+
+    // Compressors are shared, so each file gets enough blocks in flight to keep them all busy
+    stats_phase("copy");
+    int ncompress = 0;
+    pthread_t ztids[MAX_THREADS];
+    if (opt_z && !opt_R) {
+        ncompress = nthreads;
+        for (int i = 0; i < ncompress; i++) {
+            if (pthread_create(&ztids[i], NULL, compressor_main, NULL) != 0) {
+                fprintf(stderr, "Failed to create thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (nthreads > pool.nfiles)
+        nthreads = pool.nfiles;
+    pool.depth = 2 * ncompress / nthreads;
+    if (pool.depth < 4)
+        pool.depth = 4;
+    if (pool.depth > 64)
+        pool.depth = 64;
+
+    pthread_t tids[MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, worker_main, &pool) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    pthread_mutex_lock(&zq.lock);
+    zq.stop = 1;
+    pthread_cond_broadcast(&zq.work);
+    pthread_mutex_unlock(&zq.lock);
+    for (int i = 0; i < ncompress; i++)
+        pthread_join(ztids[i], NULL);
+
+    // Report problems in the order the files were given
+    stats_phase("report");
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < pool.nfiles; i++) {
+        switch (pool.result[i]) {
+            case ERR_MISSING:
+                printf("%s does not exist.\n", pool.files[i]);
+                break;
+            case ERR_ISDIR:
+                fprintf(stderr, "%s is a directory, not a file.\n", pool.files[i]);
+                status = EXIT_FAILURE;
+                break;
+            case ERR_IO:
+                fprintf(stderr, "%s%s: %s\n", pool.files[i],
+                        pool.on_backup[i] ? (store != NULL ? RECIPE_SUFFIX : opt_z ? ZIP_SUFFIX : SUFFIX) : "",
+                        strerror(pool.err[i]));
+                status = EXIT_FAILURE;
+                break;
+        }
+    }
+
+    // Logical and copied bytes for every plain copy, so holes and reflinks show up, and with -i
+    // for the files skipped or rewritten block by block too
+    if (opt_v) {
+        static const char *how[] = { "clone", "copy_file_range", "read/write", "sparse", "unchanged", "delta" };
+        uint64_t total_logical = 0, total_copied = 0;
+        for (int i = 0; i < pool.nfiles; i++) {
+            if (pool.result[i] > DONE_DELTA)
+                continue;
+            printf("%s%s: %llu bytes, %llu copied (%s)\n", pool.files[i], SUFFIX,
+                   (unsigned long long)pool.logical[i], (unsigned long long)pool.copied[i],
+                   how[pool.result[i]]);
+            total_logical += pool.logical[i];
+            total_copied += pool.copied[i];
+        }
+        printf("total: %llu bytes, %llu copied\n", (unsigned long long)total_logical,
+               (unsigned long long)total_copied);
+    }
+
+    // Files backed up this run get fresh entries; others keep theirs
+    if (opt_i) {
+        stats_phase("manifest");
+        for (int i = 0; i < pool.nfiles; i++)
+            if (pool.entries[i] != NULL)
+                free_entry(manifest_put(&manifest, pool.entries[i]));
+        if (manifest_save(&manifest, manifest_path) < 0) {
+            perror(manifest_path);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.entries);
+    free(pool.result);
+    free(pool.err);
+    free(pool.on_backup);
+    free(pool.logical);
+    free(pool.copied);
+    return status;
+}
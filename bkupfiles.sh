@@ -18,7 +18,7 @@ fi
 
 # Iterate through the command-line arguments
 for file in "$@"; do
-    if [ -e "$file" ] || [ -e "file.bck" ]; then
+    if [ -e "$file" ]; then
         # Create a copy with the ending .bck suffix
         cp -f "$file" "$file.bck"
     else
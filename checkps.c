@@ -0,0 +1,1418 @@
+/*
+#  Title          : checkps.c
+#  Author         : Brandon Cohen
+#  Created on     : October 2, 2023
+#  Description    : A C program that lists the running processes every N seconds. N may be a fraction, like 0.1.
+#  Purpose        : A native replacement for checkps,sh, which forks ps for every sample.
+#  Usage          : ./checkps [-c count] [-i seconds] [-o log] [-q] [--top N] [--sort cpu|rss|io]
+#                             [--filter user=U,comm=C] [--stats] [N]
+#                   ./checkps -e [-c count] [-i seconds]
+#                   ./checkps -r log
+#  Build with     : gcc -O2 checkps.c -o checkps
+#  Modifications  : Each sample is diffed against the last one for CPU%, RSS change, fault and I/O rates.
+#                   Added -o, a compact binary history, and -r to print it.
+#                   Added -e, which reports every process start and exit as it happens.
+#                   Added --top, --sort and --filter.
+#                   Added --stats.
+*/
+
+/*
+Instead of running ps, which rereads all of /proc on every call, the processes are sampled
+directly. /proc is listed with getdents64() into a large buffer, and the pids found are looked
+up in a hash table of the processes seen last time. A new process has its stat and statm files
+opened once, and every later sample rereads them with pread() at offset 0, which costs two
+system calls per process and no path lookups. A file opened for a process keeps pointing at it,
+so once the process exits its reads fail and the entry is dropped, even if the pid is reused.
+Processes that vanished from the listing are closed at the end of the scan. If the fd limit is
+reached, the remaining processes are opened and closed on every sample instead.
+
+Samples are taken at fixed times on the monotonic clock, so the time spent sampling and
+printing does not stretch the interval. Each process keeps its counters from the last sample,
+so every sample shows CPU%, the change in RSS, faults per second and /proc/<pid>/io read and
+write rates over the interval just ended. A process seen for the first time shows zero rates.
+
+With -o the rates also go into a fixed-size ring of records in memory, which is encoded and
+appended to the log whenever it is half full and at exit. -c 0 samples until interrupted.
+Only processes that used CPU, faulted, did I/O or changed RSS are logged, and each record
+is varints: the pid as a difference from the previous pid, the rates, and RSS as a zigzag
+difference from the last RSS logged for that pid. The command name is stored only for a pid
+not logged before or with a new start time. -r decodes a log back into text.
+
+With -e nothing is sampled. Instead the kernel proc connector, a netlink socket, sends an event
+for every fork, exec, rename and exit, so processes that live for a millisecond are still seen
+and nothing runs while the system is idle. The processes alive at start are read from /proc,
+and lifetimes are tracked in a hash table keyed by pid and start time, so a reused pid is a
+new entry. Threads are ignored. Listening needs CAP_NET_ADMIN in the initial network namespace;
+without it the processes are polled every interval instead, which can only notice processes
+that span a sample. -e runs until interrupted, or for count intervals when -i or N is given.
+
+--filter drops processes during the scan, before anything else is read for them. A process
+of another user is found with one fstatat() when it first appears, and is kept in the table
+with no files open, so later scans skip it for free. The /proc inode from getdents64() tells
+when its pid has been reused. A process with another command name has its stat read, since
+exec can rename it, but not its statm or io. --top N keeps the N largest of the remaining
+processes by --sort key in a min-heap, so ranking costs O(m log N) for m matching processes.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <pwd.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include "stats.h"
+
+#define DEFAULT_RUNS  5             // Samples taken, as in checkps,sh
+#define DENTS_BUF     (64 * 1024)
+#define STAT_BUF      1024          // Longer than any /proc/<pid>/stat line
+#define OUT_BUF       (256 * 1024)
+#define RING_RECORDS  65536         // Rates held in memory before they are encoded
+#define LOG_MAGIC     "CKPSLOG1"
+#define LOG_SESSION   0             // Tags in the log
+#define LOG_FRAME     1
+#define EVENT_BUF     (64 * 1024)
+
+// Layout of the records getdents64() returns
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// One process, with its files kept open between samples
+typedef struct {
+    int pid, ppid;
+    int stat_fd, statm_fd;          // -1 if the fd limit was hit; then opened for each sample
+    unsigned long long start;       // Start time in clock ticks after boot
+    char state;
+    char comm[17];
+    unsigned long long utime, stime;
+    unsigned long minflt, majflt;
+    unsigned long long read_bytes, write_bytes;
+    long rss;                       // Resident pages
+    int io_fd;                      // Like stat_fd, or -2 if /proc/<pid>/io may not be read
+    int fresh;                      // Nothing yet to diff against
+    int filtered;                   // Another user's process, kept only to be skipped
+    int skipped;                    // The command name did not match in the last sample
+    unsigned long long ino;         // Of /proc/<pid>, to notice a filtered pid being reused
+
+    // Rates over the last interval
+    unsigned cpu;                   // Tenths of a percent of one CPU
+    long rss_delta;                 // kB
+    unsigned long fault_rate;       // Per second
+    unsigned long read_rate, write_rate;    // kB per second
+} Proc;
+
+// One logged process in one sample
+typedef struct {
+    uint64_t ms;                    // Since the session started
+    uint64_t start;
+    int pid;
+    uint32_t cpu, rss, faults, rd, wr;
+    char comm[17];
+} Rate;
+
+// What the writer and reader of a log remember about a pid
+typedef struct {
+    int pid;                        // 0 for an empty slot
+    uint32_t rss;
+    uint64_t start;
+    char comm[17];
+} PidState;
+
+typedef struct {
+    PidState *slots;
+    size_t nslots, count;
+} PidMap;
+
+// A process being followed with -e
+typedef struct {
+    int pid;                        // 0 for an empty slot
+    int ppid;
+    uint64_t start;                 // Nanoseconds on the monotonic clock
+    unsigned gen;                   // Last poll that saw it, when polling
+    char comm[17];
+} Life;
+
+// Lifetimes by pid and start time. Probing starts from the pid alone, so the one live
+// entry for a pid is found at its exit. Deletion shifts entries back, leaving no tombstones.
+typedef struct {
+    Life *slots;
+    size_t nslots, count;
+} LifeTable;
+
+// Processes by pid, with open addressing. Rebuilt on every scan, so nothing is ever deleted.
+typedef struct {
+    Proc **slots;
+    size_t nslots;                  // Power of two
+    size_t count;
+} Table;
+
+static int proc_fd;                 // /proc, for getdents64() and openat()
+static int fd_limit_hit;
+static long ticks, page_kb;
+static volatile sig_atomic_t stop;
+
+enum { SORT_NONE, SORT_CPU, SORT_RSS, SORT_IO };
+
+// --filter and --sort
+static struct {
+    int by_user;
+    uid_t uid;
+    const char *comm;
+    int sort;
+} filter;
+
+// Rates waiting to be logged
+static struct {
+    Rate *recs;
+    size_t head, count;
+} ring;
+
+static void usage(void) {
+    fprintf(stderr, "./checkps [-c count] [-i seconds] [-o log] [-q] [--top N] [--sort cpu|rss|io]\n");
+    fprintf(stderr, "          [--filter user=U,comm=C] [--stats] [num_of_seconds]\n");
+    fprintf(stderr, "./checkps -e [-c count] [-i seconds]\n");
+    fprintf(stderr, "./checkps -r log\n");
+}
+
+static size_t table_home(const Table *t, int pid) {
+    return ((unsigned)pid * 2654435761u) & (t->nslots - 1);
+}
+
+static Proc *table_find(const Table *t, int pid) {
+    if (t->nslots == 0)
+        return NULL;
+    for (size_t i = table_home(t, pid); t->slots[i] != NULL; i = (i + 1) & (t->nslots - 1))
+        if (t->slots[i]->pid == pid)
+            return t->slots[i];
+    return NULL;
+}
+
+// Make room for n entries at no more than half load, emptying the table.
+static void table_reset(Table *t, size_t n) {
+    size_t want = 64;
+
+    while (want < 2 * n)
+        want *= 2;
+    if (want != t->nslots) {
+        free(t->slots);
+        t->nslots = want;
+        t->slots = malloc(want * sizeof(Proc *));
+        if (t->slots == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memset(t->slots, 0, t->nslots * sizeof(Proc *));
+    t->count = 0;
+}
+
+static void table_put(Table *t, Proc *p) {
+    size_t i = table_home(t, p->pid);
+
+    while (t->slots[i] != NULL)
+        i = (i + 1) & (t->nslots - 1);
+    t->slots[i] = p;
+    t->count++;
+}
+
+static void proc_close(Proc *p) {
+    if (p->stat_fd >= 0)
+        close(p->stat_fd);
+    if (p->statm_fd >= 0)
+        close(p->statm_fd);
+    if (p->io_fd >= 0)
+        close(p->io_fd);
+    free(p);
+}
+
+// Read a whole /proc file for a process, through its open fd or by name.
+static ssize_t proc_read(int fd, int pid, const char *name, char *buf, size_t size) {
+    ssize_t n;
+
+    if (fd >= 0) {
+        n = pread(fd, buf, size - 1, 0);
+    } else {
+        char path[32];
+        snprintf(path, sizeof(path), "%d/%s", pid, name);
+        if ((fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
+            return -1;
+        n = read(fd, buf, size - 1);
+        close(fd);
+    }
+    if (n >= 0)
+        buf[n] = '\0';
+    return n;
+}
+
+static unsigned long long next_field(char **s) {
+    char *p = *s;
+    unsigned long long v = 0;
+
+    while (*p == ' ')
+        p++;
+    while (*p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+    *s = p;
+    return v;
+}
+
+static void skip_fields(char **s, int n) {
+    char *p = *s;
+
+    while (n-- > 0) {
+        while (*p == ' ')
+            p++;
+        while (*p != ' ' && *p != '\0')
+            p++;
+    }
+    *s = p;
+}
+
+// Fill p from the text of /proc/<pid>/stat. The command name may hold spaces and
+// parentheses, so the fields are counted from the last ')'.
+static int parse_stat(Proc *p, char *buf, ssize_t n) {
+    char *open = memchr(buf, '(', n);
+    char *close = memrchr(buf, ')', n);
+
+    if (open == NULL || close == NULL || close < open || close + 3 >= buf + n)
+        return -1;
+    size_t len = close - open - 1;
+    if (len > sizeof(p->comm) - 1)
+        len = sizeof(p->comm) - 1;
+    memcpy(p->comm, open + 1, len);
+    p->comm[len] = '\0';
+
+    char *s = close + 2;
+    p->state = *s++;
+    p->ppid = (int)next_field(&s);
+    skip_fields(&s, 5);                 // pgrp session tty_nr tpgid flags
+    p->minflt = next_field(&s);
+    skip_fields(&s, 1);                 // cminflt
+    p->majflt = next_field(&s);
+    skip_fields(&s, 1);                 // cmajflt
+    p->utime = next_field(&s);
+    p->stime = next_field(&s);
+    skip_fields(&s, 6);                 // cutime cstime priority nice num_threads itrealvalue
+    p->start = next_field(&s);
+    return 0;
+}
+
+static unsigned long long io_field(char *buf, const char *name) {
+    char *s = strstr(buf, name);
+
+    if (s == NULL)
+        return 0;
+    s += strlen(name);
+    return next_field(&s);
+}
+
+// Read the current stat, statm and io of a process, and the rates since the last read
+// dt seconds ago. Fails once the process has exited, or when its pid now belongs to another.
+static int sample_proc(Proc *p, double dt) {
+    char buf[STAT_BUF];
+    unsigned long long cpu0 = p->utime + p->stime, faults0 = p->minflt + p->majflt;
+    unsigned long long rd0 = p->read_bytes, wr0 = p->write_bytes, start0 = p->start;
+    long rss0 = p->rss;
+    ssize_t n = proc_read(p->stat_fd, p->pid, "stat", buf, sizeof(buf));
+
+    if (n <= 0 || parse_stat(p, buf, n) < 0)
+        return -1;
+
+    // Open files fail once the process is gone, but files read by path after the fd limit
+    // was hit show whatever process has the pid now, so the start time tells them apart
+    if (start0 != 0 && p->start != start0)
+        return -1;
+
+    // A process renamed into the filter starts over, since its counters were not followed
+    if (filter.comm != NULL && strcmp(p->comm, filter.comm) != 0) {
+        p->skipped = 1;
+        return 0;
+    }
+    if (p->skipped) {
+        p->skipped = 0;
+        p->fresh = 1;
+    }
+
+    n = proc_read(p->statm_fd, p->pid, "statm", buf, sizeof(buf));
+    if (n <= 0)
+        return -1;
+    char *s = buf;
+    skip_fields(&s, 1);                 // size
+    p->rss = next_field(&s);
+
+    // Other users' io files are off limits without privileges; those show no I/O
+    if (p->io_fd != -2) {
+        if ((n = proc_read(p->io_fd, p->pid, "io", buf, sizeof(buf))) > 0) {
+            p->read_bytes = io_field(buf, "read_bytes:");
+            p->write_bytes = io_field(buf, "write_bytes:");
+        } else if (errno == EACCES || errno == EPERM) {
+            if (p->io_fd >= 0)
+                close(p->io_fd);
+            p->io_fd = -2;
+        }
+    }
+
+    if (p->fresh || dt <= 0) {
+        p->fresh = 0;
+        p->cpu = 0;
+        p->rss_delta = 0;
+        p->fault_rate = p->read_rate = p->write_rate = 0;
+        return 0;
+    }
+    p->cpu = (unsigned)((p->utime + p->stime - cpu0) * 1000.0 / ticks / dt + 0.5);
+    p->rss_delta = (p->rss - rss0) * page_kb;
+    p->fault_rate = (unsigned long)((p->minflt + p->majflt - faults0) / dt + 0.5);
+    p->read_rate = p->read_bytes >= rd0 ? (unsigned long)((p->read_bytes - rd0) / 1024 / dt + 0.5) : 0;
+    p->write_rate = p->write_bytes >= wr0 ? (unsigned long)((p->write_bytes - wr0) / 1024 / dt + 0.5) : 0;
+    return 0;
+}
+
+// Open the files of a newly seen process and take its first sample.
+static Proc *proc_open(int pid, const char *name, unsigned long long ino) {
+    Proc *p = calloc(1, sizeof(Proc));
+    char path[32];
+
+    if (p == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    p->pid = pid;
+    p->ino = ino;
+    p->stat_fd = p->statm_fd = p->io_fd = -1;
+    p->fresh = 1;
+
+    // /proc/<pid> belongs to the process's effective user
+    if (filter.by_user) {
+        struct stat st;
+        if (fstatat(proc_fd, name, &st, 0) < 0) {
+            free(p);
+            return NULL;
+        }
+        if (st.st_uid != filter.uid) {
+            p->filtered = 1;
+            return p;
+        }
+    }
+    if (!fd_limit_hit) {
+        snprintf(path, sizeof(path), "%d/stat", pid);
+        p->stat_fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, sizeof(path), "%d/statm", pid);
+        p->statm_fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, sizeof(path), "%d/io", pid);
+        p->io_fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+        if (p->io_fd < 0 && (errno == EACCES || errno == EPERM))
+            p->io_fd = -2;
+        if ((p->stat_fd < 0 || p->statm_fd < 0 || p->io_fd == -1) && (errno == EMFILE || errno == ENFILE)) {
+            fd_limit_hit = 1;
+            if (p->stat_fd >= 0)
+                close(p->stat_fd);
+            if (p->statm_fd >= 0)
+                close(p->statm_fd);
+            if (p->io_fd >= 0)
+                close(p->io_fd);
+            p->stat_fd = p->statm_fd = p->io_fd = -1;
+        }
+    }
+    if (sample_proc(p, 0) < 0) {
+        proc_close(p);
+        return NULL;
+    }
+    return p;
+}
+
+// Take one sample of every process, dt seconds after the last. cur is rebuilt from prev,
+// and list receives the processes in /proc order. Returns the number of processes.
+static size_t scan(Table *prev, Table *cur, Proc ***list, size_t *cap, double dt) {
+    static char dents[DENTS_BUF];
+    size_t n = 0;
+
+    table_reset(cur, prev->count);
+    if (lseek(proc_fd, 0, SEEK_SET) < 0) {
+        perror("/proc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        long len = syscall(SYS_getdents64, proc_fd, dents, sizeof(dents));
+        if (len < 0) {
+            perror("/proc");
+            exit(EXIT_FAILURE);
+        }
+        if (len == 0)
+            break;
+
+        for (long off = 0; off < len; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + off);
+            off += d->d_reclen;
+            if (d->d_name[0] < '1' || d->d_name[0] > '9')
+                continue;
+            int pid = 0;
+            for (const char *c = d->d_name; *c >= '0' && *c <= '9'; c++)
+                pid = pid * 10 + (*c - '0');
+
+            // A known process is reread; one whose read fails has exited, and its pid may be reused
+            Proc *p = table_find(prev, pid);
+            if (p != NULL && p->filtered && p->ino != d->d_ino)
+                p = NULL;
+            else if (p != NULL && !p->filtered && sample_proc(p, dt) < 0)
+                p = NULL;
+            if (p == NULL && (p = proc_open(pid, d->d_name, d->d_ino)) == NULL)
+                continue;
+
+            if (cur->count * 2 >= cur->nslots) {
+                Table grown = { NULL, 0, 0 };
+                table_reset(&grown, cur->nslots);
+                for (size_t i = 0; i < cur->nslots; i++)
+                    if (cur->slots[i] != NULL)
+                        table_put(&grown, cur->slots[i]);
+                free(cur->slots);
+                *cur = grown;
+            }
+            table_put(cur, p);
+            if (p->filtered || p->skipped)
+                continue;
+            if (n == *cap) {
+                *cap = *cap ? 2 * *cap : 1024;
+                *list = realloc(*list, *cap * sizeof(Proc *));
+                if (*list == NULL) {
+                    fprintf(stderr, "Failed to allocate memory\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            (*list)[n++] = p;
+        }
+    }
+
+    // Anything in prev that did not make it into cur has exited
+    for (size_t i = 0; i < prev->nslots; i++) {
+        Proc *p = prev->slots[i];
+        if (p != NULL && table_find(cur, p->pid) != p)
+            proc_close(p);
+    }
+    return n;
+}
+
+static unsigned long long sort_key(const Proc *p) {
+    switch (filter.sort) {
+        case SORT_CPU:
+            return p->cpu;
+        case SORT_RSS:
+            return p->rss;
+        default:
+            return p->read_rate + p->write_rate;
+    }
+}
+
+// Heap order: smaller key first, and the higher pid first among equal keys
+static int ranks_below(const Proc *a, const Proc *b) {
+    unsigned long long ka = sort_key(a), kb = sort_key(b);
+    return ka < kb || (ka == kb && a->pid > b->pid);
+}
+
+static void sift_down(Proc **heap, size_t n, size_t i) {
+    for (;;) {
+        size_t least = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && ranks_below(heap[l], heap[least]))
+            least = l;
+        if (r < n && ranks_below(heap[r], heap[least]))
+            least = r;
+        if (least == i)
+            return;
+        Proc *t = heap[i];
+        heap[i] = heap[least];
+        heap[least] = t;
+        i = least;
+    }
+}
+
+// Move the top of the n processes in list to its front, largest first, and return how many.
+static size_t top_n(Proc **list, size_t n, size_t top) {
+    if (top > n)
+        top = n;
+
+    // A min-heap of the best so far; its root is the one to beat
+    for (size_t i = top / 2; i-- > 0; )
+        sift_down(list, top, i);
+    for (size_t i = top; i < n; i++) {
+        if (top > 0 && ranks_below(list[0], list[i])) {
+            list[0] = list[i];
+            sift_down(list, top, 0);
+        }
+    }
+
+    // Taking the smallest off the end each time leaves the heap in descending order
+    for (size_t end = top; end > 1; end--) {
+        Proc *t = list[0];
+        list[0] = list[end - 1];
+        list[end - 1] = t;
+        sift_down(list, end - 1, 0);
+    }
+    return top;
+}
+
+// Parse --filter user=NAME,comm=NAME.
+static int parse_filter(char *arg) {
+    for (char *item = strtok(arg, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (strncmp(item, "user=", 5) == 0) {
+            char *endptr;
+            struct passwd *pw = getpwnam(item + 5);
+            filter.by_user = 1;
+            if (pw != NULL) {
+                filter.uid = pw->pw_uid;
+            } else {
+                errno = 0;
+                unsigned long uid = strtoul(item + 5, &endptr, 10);
+                if (item[5] < '0' || item[5] > '9' || *endptr != '\0' || errno == ERANGE) {
+                    fprintf(stderr, "%s is not a known user.\n", item + 5);
+                    return -1;
+                }
+                filter.uid = (uid_t)uid;
+            }
+        } else if (strncmp(item, "comm=", 5) == 0) {
+            filter.comm = item + 5;
+        } else {
+            fprintf(stderr, "%s is not a filter. Use user= or comm=.\n", item);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void print_sample(Proc **list, size_t n) {
+    printf("    PID S     TIME  %%CPU      RSS    dRSS  FLT/s   RD kB/s   WR kB/s CMD\n");
+    for (size_t i = 0; i < n; i++) {
+        Proc *p = list[i];
+        unsigned long long secs = (p->utime + p->stime) / ticks;
+        printf("%7d %c %02llu:%02llu:%02llu %3u.%u %8ld %7ld %6lu %9lu %9lu %s\n", p->pid, p->state,
+               secs / 3600, secs / 60 % 60, secs % 60, p->cpu / 10, p->cpu % 10, p->rss * page_kb,
+               p->rss_delta, p->fault_rate, p->read_rate, p->write_rate, p->comm);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static size_t put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    uint64_t r = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p >= end)
+            return -1;
+        unsigned char b = *(*p)++;
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Find the state for pid, adding an empty one if it is new.
+static PidState *pidmap_get(PidMap *m, int pid) {
+    if (2 * (m->count + 1) > m->nslots) {
+        PidMap grown = { NULL, m->nslots ? 2 * m->nslots : 1024, 0 };
+        grown.slots = calloc(grown.nslots, sizeof(PidState));
+        if (grown.slots == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < m->nslots; i++)
+            if (m->slots[i].pid != 0)
+                *pidmap_get(&grown, m->slots[i].pid) = m->slots[i];
+        free(m->slots);
+        *m = grown;
+    }
+
+    size_t i = ((unsigned)pid * 2654435761u) & (m->nslots - 1);
+    while (m->slots[i].pid != 0 && m->slots[i].pid != pid)
+        i = (i + 1) & (m->nslots - 1);
+    if (m->slots[i].pid == 0) {
+        memset(&m->slots[i], 0, sizeof(PidState));
+        m->slots[i].pid = pid;
+        m->count++;
+    }
+    return &m->slots[i];
+}
+
+// Encode the rates in the ring, one frame per sample, and append them to the log.
+static void log_flush(int fd, const char *path, PidMap *seen) {
+    // Worst case per record: six 10-byte varints and a name
+    size_t cap = ring.count * 80 + 32, len = 0;
+    unsigned char *out = malloc(cap);
+
+    if (out == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    static uint64_t last_ms;
+    for (size_t i = 0; i < ring.count; ) {
+        // Records of one sample are adjacent and in pid order
+        uint64_t ms = ring.recs[(ring.head + i) % RING_RECORDS].ms;
+        size_t j = i;
+        while (j < ring.count && ring.recs[(ring.head + j) % RING_RECORDS].ms == ms)
+            j++;
+
+        out[len++] = LOG_FRAME;
+        len += put_varint(out + len, ms - last_ms);
+        last_ms = ms;
+        unsigned char *count_at = out + len;
+        size_t nrec = 0;
+        len += 5;       // Patched below; a padded varint can hold any count up to 2^35
+
+        int prev_pid = 0;
+        for (; i < j; i++) {
+            Rate *r = &ring.recs[(ring.head + i) % RING_RECORDS];
+            PidState *st = pidmap_get(seen, r->pid);
+            int new_name = st->start != r->start || st->comm[0] == '\0';
+            if (!new_name && r->cpu == 0 && r->faults == 0 && r->rd == 0 && r->wr == 0 && r->rss == st->rss)
+                continue;
+
+            len += put_varint(out + len, (uint64_t)(r->pid - prev_pid) << 1 | new_name);
+            prev_pid = r->pid;
+            if (new_name) {
+                size_t n = strlen(r->comm);
+                out[len++] = (unsigned char)n;
+                memcpy(out + len, r->comm, n);
+                len += n;
+                len += put_varint(out + len, r->start);
+                st->start = r->start;
+                memcpy(st->comm, r->comm, sizeof(st->comm));
+            }
+            len += put_varint(out + len, r->cpu);
+            len += put_varint(out + len, zigzag((int64_t)r->rss - st->rss));
+            len += put_varint(out + len, r->faults);
+            len += put_varint(out + len, r->rd);
+            len += put_varint(out + len, r->wr);
+            st->rss = r->rss;
+            nrec++;
+        }
+        for (int k = 0; k < 4; k++)
+            count_at[k] = (unsigned char)(nrec >> (7 * k)) | 0x80;
+        count_at[4] = (unsigned char)(nrec >> 28);
+    }
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(fd, out + done, len - done);
+        if (n < 0 && errno != EINTR) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        if (n > 0)
+            done += n;
+    }
+    free(out);
+    ring.head = ring.count = 0;
+}
+
+// Queue the rates of one sample for the log.
+static void log_sample(Proc **list, size_t n, uint64_t ms, int fd, const char *path, PidMap *seen) {
+    if (ring.count + n > RING_RECORDS)
+        log_flush(fd, path, seen);
+
+    for (size_t i = 0; i < n; i++) {
+        Proc *p = list[i];
+        if (ring.count == RING_RECORDS)     // One sample larger than the ring; the rest waits for the next
+            log_flush(fd, path, seen);
+        Rate *r = &ring.recs[(ring.head + ring.count++) % RING_RECORDS];
+        r->ms = ms;
+        r->start = p->start;
+        r->pid = p->pid;
+        r->cpu = p->cpu;
+        r->rss = (uint32_t)(p->rss * page_kb);
+        r->faults = (uint32_t)p->fault_rate;
+        r->rd = (uint32_t)p->read_rate;
+        r->wr = (uint32_t)p->write_rate;
+        memcpy(r->comm, p->comm, sizeof(r->comm));
+    }
+    if (ring.count >= RING_RECORDS / 2)
+        log_flush(fd, path, seen);
+}
+
+// Print a log written with -o.
+static int read_log(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    unsigned char *data = malloc(st.st_size + 1);
+    if (data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    ssize_t got = 0;
+    while (got < st.st_size) {
+        ssize_t n = read(fd, data + got, st.st_size - got);
+        if (n <= 0) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        got += n;
+    }
+    close(fd);
+
+    const unsigned char *p = data, *end = data + st.st_size;
+    if (st.st_size < 8 || memcmp(p, LOG_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a checkps log.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    p += 8;
+
+    PidMap seen = { NULL, 0, 0 };
+    uint64_t session = 0, ms = 0, v;
+    while (p < end) {
+        int tag = *p++;
+        if (tag == LOG_SESSION) {
+            // Each run appends a session, and deltas start over
+            if (get_varint(&p, end, &session) < 0)
+                goto bad;
+            free(seen.slots);
+            seen.slots = NULL;
+            seen.nslots = seen.count = 0;
+            ms = 0;
+            continue;
+        }
+        if (tag != LOG_FRAME || get_varint(&p, end, &v) < 0)
+            goto bad;
+        ms += v;
+
+        time_t secs = (session + ms) / 1000;
+        struct tm tm;
+        char when[32];
+        localtime_r(&secs, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        printf("%s.%03u\n", when, (unsigned)((session + ms) % 1000));
+        printf("    PID  %%CPU      RSS    dRSS  FLT/s   RD kB/s   WR kB/s CMD\n");
+
+        uint64_t nrec;
+        int pid = 0;
+        if (get_varint(&p, end, &nrec) < 0)
+            goto bad;
+        for (uint64_t i = 0; i < nrec; i++) {
+            uint64_t head, cpu, drss, faults, rd, wr;
+            if (get_varint(&p, end, &head) < 0)
+                goto bad;
+            pid += (int)(head >> 1);
+            PidState *s = pidmap_get(&seen, pid);
+            if (head & 1) {
+                if (p >= end || *p > 16 || end - p < 1 + *p)
+                    goto bad;
+                memcpy(s->comm, p + 1, *p);
+                s->comm[*p] = '\0';
+                p += 1 + *p;
+                if (get_varint(&p, end, &s->start) < 0)
+                    goto bad;
+            }
+            if (get_varint(&p, end, &cpu) < 0 || get_varint(&p, end, &drss) < 0 ||
+                get_varint(&p, end, &faults) < 0 || get_varint(&p, end, &rd) < 0 ||
+                get_varint(&p, end, &wr) < 0)
+                goto bad;
+            int64_t delta = unzigzag(drss);
+            s->rss += (uint32_t)delta;
+            printf("%7d %3u.%u %8u %7lld %6llu %9llu %9llu %s\n", pid, (unsigned)(cpu / 10),
+                   (unsigned)(cpu % 10), s->rss, (long long)delta, (unsigned long long)faults,
+                   (unsigned long long)rd, (unsigned long long)wr, s->comm);
+        }
+        printf("\n");
+    }
+    free(seen.slots);
+    free(data);
+    return EXIT_SUCCESS;
+
+bad:
+    fflush(stdout);
+    fprintf(stderr, "%s is damaged at byte %ld.\n", path, (long)(p - data));
+    exit(EXIT_FAILURE);
+}
+
+static size_t life_home(const LifeTable *t, int pid) {
+    return ((unsigned)pid * 2654435761u) & (t->nslots - 1);
+}
+
+static Life *life_find(LifeTable *t, int pid) {
+    for (size_t i = life_home(t, pid); t->slots[i].pid != 0; i = (i + 1) & (t->nslots - 1))
+        if (t->slots[i].pid == pid)
+            return &t->slots[i];
+    return NULL;
+}
+
+// Add a process. An entry left for the same pid, from an exit that was missed, is replaced.
+static Life *life_add(LifeTable *t, int pid, uint64_t start) {
+    Life *l = life_find(t, pid);
+
+    if (l == NULL && 2 * (t->count + 1) > t->nslots) {
+        LifeTable grown = { NULL, 2 * t->nslots, 0 };
+        if ((grown.slots = calloc(grown.nslots, sizeof(Life))) == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < t->nslots; i++)
+            if (t->slots[i].pid != 0)
+                *life_add(&grown, t->slots[i].pid, t->slots[i].start) = t->slots[i];
+        free(t->slots);
+        *t = grown;
+    }
+    if (l == NULL) {
+        size_t i = life_home(t, pid);
+        while (t->slots[i].pid != 0)
+            i = (i + 1) & (t->nslots - 1);
+        l = &t->slots[i];
+        t->count++;
+    }
+    memset(l, 0, sizeof(*l));
+    l->pid = pid;
+    l->start = start;
+    return l;
+}
+
+static void life_del(LifeTable *t, Life *l) {
+    size_t mask = t->nslots - 1, hole = l - t->slots;
+
+    // Move back any later entry of the cluster whose home is at or before the hole
+    for (size_t i = (hole + 1) & mask; t->slots[i].pid != 0; i = (i + 1) & mask) {
+        size_t home = life_home(t, t->slots[i].pid);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole].pid = 0;
+    t->count--;
+}
+
+static void read_comm(int pid, char *comm) {
+    char buf[32];
+    ssize_t n = proc_read(-1, pid, "comm", buf, sizeof(buf));
+
+    if (n > 0) {
+        if (buf[n - 1] == '\n')
+            buf[--n] = '\0';
+        if (n > 16)
+            buf[16] = '\0';
+        strcpy(comm, buf);
+    }
+}
+
+static uint64_t mono_to_real;       // Add to a monotonic time in ns for the wall clock
+
+static void print_event(uint64_t when, const char *what, const Life *l) {
+    time_t secs = (when + mono_to_real) / 1000000000;
+    struct tm tm;
+    char stamp[16];
+
+    localtime_r(&secs, &tm);
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+    printf("%s.%03u %-5s %7d %7d %s", stamp, (unsigned)((when + mono_to_real) / 1000000 % 1000),
+           what, l->pid, l->ppid, l->comm[0] ? l->comm : "?");
+}
+
+static void print_exit(uint64_t when, const Life *l, int status) {
+    print_event(when, "exit", l);
+    uint64_t life = when > l->start ? when - l->start : 0;
+    printf("  lived %llu.%03us", (unsigned long long)(life / 1000000000),
+           (unsigned)(life / 1000000 % 1000));
+    if (status >= 0 && WIFSIGNALED(status))
+        printf(", signal %d", WTERMSIG(status));
+    else if (status >= 0)
+        printf(", status %d", WEXITSTATUS(status));
+    printf("\n");
+}
+
+// Open a proc connector socket and ask for events. Returns -1 if that is not allowed.
+static int connector_open(void) {
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    struct sockaddr_nl addr;
+
+    if (sock < 0)
+        return -1;
+    int rcvbuf = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = getpid();
+    addr.nl_groups = CN_IDX_PROC;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int saved = errno;
+        close(sock);
+        errno = saved;
+        return -1;
+    }
+
+    union {
+        struct nlmsghdr nl;
+        char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nl.nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+    req.nl.nlmsg_type = NLMSG_DONE;
+    req.nl.nlmsg_pid = getpid();
+    struct cn_msg *cn = NLMSG_DATA(&req.nl);
+    cn->id.idx = CN_IDX_PROC;
+    cn->id.val = CN_VAL_PROC;
+    cn->len = sizeof(enum proc_cn_mcast_op);
+    *(enum proc_cn_mcast_op *)cn->data = PROC_CN_MCAST_LISTEN;
+    if (send(sock, &req, req.nl.nlmsg_len, 0) < 0) {
+        int saved = errno;
+        close(sock);
+        errno = saved;
+        return -1;
+    }
+    return sock;
+}
+
+// Apply one connector event to the table, printing what happened.
+static void handle_event(LifeTable *t, const struct proc_event *ev) {
+    Life *l, *parent;
+
+    switch (ev->what) {
+        case PROC_EVENT_FORK:
+            if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid)
+                break;      // A new thread
+            l = life_add(t, ev->event_data.fork.child_pid, ev->timestamp_ns);
+            l->ppid = ev->event_data.fork.parent_tgid;
+            if ((parent = life_find(t, l->ppid)) != NULL)
+                memcpy(l->comm, parent->comm, sizeof(l->comm));
+            else
+                read_comm(l->pid, l->comm);
+            print_event(ev->timestamp_ns, "fork", l);
+            printf("\n");
+            break;
+        case PROC_EVENT_EXEC:
+            if ((l = life_find(t, ev->event_data.exec.process_tgid)) == NULL)
+                break;
+            read_comm(l->pid, l->comm);
+            print_event(ev->timestamp_ns, "exec", l);
+            printf("\n");
+            break;
+        case PROC_EVENT_COMM:
+            if (ev->event_data.comm.process_pid != ev->event_data.comm.process_tgid ||
+                (l = life_find(t, ev->event_data.comm.process_tgid)) == NULL)
+                break;
+            memcpy(l->comm, ev->event_data.comm.comm, 16);
+            l->comm[16] = '\0';
+            break;
+        case PROC_EVENT_EXIT:
+            if (ev->event_data.exit.process_pid != ev->event_data.exit.process_tgid ||
+                (l = life_find(t, ev->event_data.exit.process_tgid)) == NULL)
+                break;
+            print_exit(ev->timestamp_ns, l, (int)ev->event_data.exit.exit_code);
+            life_del(t, l);
+            break;
+        default:
+            break;
+    }
+}
+
+// Seed the table with the processes alive now, from their start times in /proc.
+static void life_seed(LifeTable *t, Table *prev, Table *cur, Proc ***list, size_t *cap, unsigned gen) {
+    size_t n = scan(prev, cur, list, cap, 0);
+
+    for (size_t i = 0; i < n; i++) {
+        Proc *p = (*list)[i];
+        uint64_t start = p->start * (1000000000 / ticks);
+        Life *l = life_find(t, p->pid);
+        if (l == NULL || l->start != start) {
+            // Polling only learns of a process once it is running, so it is reported as a start
+            if (l != NULL && gen > 1) {
+                print_exit(start, l, -1);
+                life_del(t, l);
+            }
+            l = life_add(t, p->pid, start);
+            l->ppid = p->ppid;
+            memcpy(l->comm, p->comm, sizeof(l->comm));
+            if (gen > 1) {
+                print_event(start, "start", l);
+                printf("\n");
+            }
+        }
+        l->gen = gen;
+    }
+}
+
+// Report process starts and exits with -e until interrupted or count intervals pass.
+static int watch_events(struct timespec interval, long count, int have_interval) {
+    LifeTable lives = { NULL, 4096, 0 };
+    Table tables[2] = { { NULL, 0, 0 }, { NULL, 0, 0 } };
+    Proc **list = NULL;
+    size_t cap = 0;
+    struct timespec mono, real;
+
+    if ((lives.slots = calloc(lives.nslots, sizeof(Life))) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    uint64_t mono_ns = (uint64_t)mono.tv_sec * 1000000000 + mono.tv_nsec;
+    mono_to_real = (uint64_t)real.tv_sec * 1000000000 + real.tv_nsec - mono_ns;
+    int64_t step = have_interval ? interval.tv_sec * 1000000000LL + interval.tv_nsec : 1000000000LL;
+    uint64_t deadline = have_interval && count > 0 ? mono_ns + step * count : UINT64_MAX;
+
+    // Subscribe before reading /proc, so nothing starting in between is missed
+    int sock = connector_open();
+    if (sock < 0)
+        fprintf(stderr, "Process events are not available (%s); polling every %lld.%03lld s instead.\n",
+                strerror(errno), (long long)(step / 1000000000), (long long)(step / 1000000 % 1000));
+    life_seed(&lives, &tables[0], &tables[1], &list, &cap, 1);
+    printf("TIME         EVENT     PID    PPID CMD\n");
+    fflush(stdout);
+
+    static char buf[EVENT_BUF] __attribute__((aligned(NLMSG_ALIGNTO)));
+    unsigned gen = 1;
+    while (!stop) {
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        mono_ns = (uint64_t)mono.tv_sec * 1000000000 + mono.tv_nsec;
+        if (mono_ns >= deadline)
+            break;
+        uint64_t wait_ns = deadline - mono_ns;
+
+        if (sock < 0) {
+            // Polling: sleep an interval, then whatever vanished has exited
+            if (wait_ns > (uint64_t)step)
+                wait_ns = step;
+            struct timespec ts = { wait_ns / 1000000000, wait_ns % 1000000000 };
+            if (nanosleep(&ts, NULL) < 0 && stop)
+                break;
+            gen++;
+            life_seed(&lives, &tables[(gen + 1) % 2], &tables[gen % 2], &list, &cap, gen);
+            clock_gettime(CLOCK_MONOTONIC, &mono);
+            mono_ns = (uint64_t)mono.tv_sec * 1000000000 + mono.tv_nsec;
+            for (size_t i = 0; i < lives.nslots; i++) {
+                Life *l = &lives.slots[i];
+                if (l->pid != 0 && l->gen != gen) {
+                    print_exit(mono_ns, l, -1);
+                    life_del(&lives, l);
+                    i--;        // Another entry may have moved into this slot
+                }
+            }
+            fflush(stdout);
+            continue;
+        }
+
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        int timeout = wait_ns / 1000000 > 1000 ? 1000 : (int)(wait_ns / 1000000) + 1;
+        if (poll(&pfd, 1, timeout) <= 0)
+            continue;
+        ssize_t len = recv(sock, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == ENOBUFS)
+                fprintf(stderr, "Events were lost because they came faster than they were read.\n");
+            else if (errno != EINTR) {
+                perror("recv");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        for (struct nlmsghdr *nl = (struct nlmsghdr *)buf; NLMSG_OK(nl, (size_t)len); nl = NLMSG_NEXT(nl, len)) {
+            struct cn_msg *cn = NLMSG_DATA(nl);
+            if (nl->nlmsg_type == NLMSG_ERROR || nl->nlmsg_type == NLMSG_NOOP ||
+                cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+                continue;
+            handle_event(&lives, (struct proc_event *)cn->data);
+        }
+        fflush(stdout);
+    }
+
+    if (sock >= 0)
+        close(sock);
+    Table *final = &tables[gen % 2];
+    for (size_t i = 0; i < final->nslots; i++)
+        if (final->slots[i] != NULL)
+            proc_close(final->slots[i]);
+    free(tables[0].slots);
+    free(tables[1].slots);
+    free(list);
+    free(lives.slots);
+    fflush(stdout);
+    return EXIT_SUCCESS;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+// Parse a positive number of seconds, which may have a fraction.
+static int parse_interval(const char *s, struct timespec *ts) {
+    char *endptr;
+
+    errno = 0;
+    double secs = strtod(s, &endptr);
+    if (*s < '0' || *s > '9' || *endptr != '\0' || errno == ERANGE || secs > 1e9)
+        return -1;
+    ts->tv_sec = (time_t)secs;
+    ts->tv_nsec = (long)((secs - ts->tv_sec) * 1e9);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct timespec interval = { 0, 0 };
+    long count = DEFAULT_RUNS;
+    int have_interval = 0;
+    int quiet = 0;
+    int events = 0;
+    long top = -1;
+    const char *log_path = NULL;
+    int opt;
+    char *endptr;
+
+    stats_init(&argc, argv);
+    stats_phase("parse");
+
+    static struct option long_options[] = {
+        { "count",    required_argument, NULL, 'c' },
+        { "interval", required_argument, NULL, 'i' },
+        { "output",   required_argument, NULL, 'o' },
+        { "quiet",    no_argument,       NULL, 'q' },
+        { "read",     required_argument, NULL, 'r' },
+        { "events",   no_argument,       NULL, 'e' },
+        { "top",      required_argument, NULL, 't' },
+        { "sort",     required_argument, NULL, 's' },
+        { "filter",   required_argument, NULL, 'f' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "c:i:o:qr:et:s:f:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                errno = 0;
+                count = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || errno == ERANGE || count < 0) {
+                    fprintf(stderr, "%s is not a valid count.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                if (parse_interval(optarg, &interval) < 0) {
+                    fprintf(stderr, "Invalid argument. Please provide a positive number of seconds.\n");
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                have_interval = 1;
+                break;
+            case 'o':
+                log_path = optarg;
+                break;
+            case 'q':
+                quiet++;
+                break;
+            case 'r':
+                return read_log(optarg);
+            case 'e':
+                events++;
+                break;
+            case 't':
+                errno = 0;
+                top = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || errno == ERANGE || top < 1) {
+                    fprintf(stderr, "%s is not a positive count.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "cpu") == 0)
+                    filter.sort = SORT_CPU;
+                else if (strcmp(optarg, "rss") == 0)
+                    filter.sort = SORT_RSS;
+                else if (strcmp(optarg, "io") == 0)
+                    filter.sort = SORT_IO;
+                else {
+                    fprintf(stderr, "Sort by cpu, rss or io.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                if (parse_filter(optarg) < 0)
+                    exit(EXIT_FAILURE);
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // Same checks as checkps,sh, unless the interval was given with -i or is not needed
+    if (argc - optind > 1 || (argc - optind == 0 && !have_interval && !events)) {
+        printf("Only 1 argument is required.\n");
+        printf("./checkps [num_of_seconds]\n");
+        exit(EXIT_FAILURE);
+    }
+    if (argc - optind == 1 && parse_interval(argv[optind], &interval) < 0) {
+        printf("Invalid argument. Please provide a positive number.\n");
+        printf("./checkps [num_of_seconds]\n");
+        exit(EXIT_FAILURE);
+    }
+    if (argc - optind == 1)
+        have_interval = 1;
+    if (events && (log_path != NULL || top > 0 || filter.sort != SORT_NONE)) {
+        fprintf(stderr, "-e cannot be combined with -o, --top or --sort.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (top > 0 && filter.sort == SORT_NONE)
+        filter.sort = SORT_CPU;
+
+    // Keeping three files open per process needs a high fd limit
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        perror("/proc");
+        exit(EXIT_FAILURE);
+    }
+
+    static char outbuf[OUT_BUF];
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+    ticks = sysconf(_SC_CLK_TCK);
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+    // Stop cleanly on a signal so the ring still reaches the log
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (events)
+        return watch_events(interval, count, have_interval);
+
+    // The log is appended to, with a new session for each run
+    int log_fd = -1;
+    PidMap seen = { NULL, 0, 0 };
+    struct timespec now;
+    uint64_t session_ms = 0;
+    if (log_path != NULL) {
+        struct stat st;
+        unsigned char head[16];
+        size_t len = 0;
+
+        if ((log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0 || fstat(log_fd, &st) < 0) {
+            perror(log_path);
+            exit(EXIT_FAILURE);
+        }
+        ring.recs = malloc(RING_RECORDS * sizeof(Rate));
+        if (ring.recs == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        clock_gettime(CLOCK_REALTIME, &now);
+        session_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        if (st.st_size == 0 && write(log_fd, LOG_MAGIC, 8) != 8) {
+            perror(log_path);
+            exit(EXIT_FAILURE);
+        }
+        head[len++] = LOG_SESSION;
+        len += put_varint(head + len, session_ms);
+        if (write(log_fd, head, len) != (ssize_t)len) {
+            perror(log_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Table tables[2] = { { NULL, 0, 0 }, { NULL, 0, 0 } };
+    Proc **list = NULL;
+    size_t cap = 0;
+    struct timespec next, last;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    last = next;
+
+    long run;
+    for (run = 0; (count == 0 || run < count) && !stop; run++) {
+        Table *prev = &tables[run % 2], *cur = &tables[(run + 1) % 2];
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double dt = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        last = now;
+        stats_phase("scan");
+        size_t n = scan(prev, cur, &list, &cap, dt);
+
+        // The log wants pid order, so it gets every matching process before ranking
+        if (log_fd >= 0) {
+            stats_phase("log");
+            clock_gettime(CLOCK_REALTIME, &now);
+            uint64_t ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+            log_sample(list, n, ms > session_ms ? ms - session_ms : 0, log_fd, log_path, &seen);
+        }
+        stats_phase("rank");
+        if (filter.sort != SORT_NONE)
+            n = top_n(list, n, top > 0 ? (size_t)top : n);
+        stats_phase("output");
+        if (!quiet)
+            print_sample(list, n);
+
+        if (count == 0 || run + 1 < count) {
+            stats_phase("sleep");
+            next.tv_sec += interval.tv_sec;
+            next.tv_nsec += interval.tv_nsec;
+            if (next.tv_nsec >= 1000000000) {
+                next.tv_sec++;
+                next.tv_nsec -= 1000000000;
+            }
+            while (!stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+                ;
+        }
+    }
+
+    if (log_fd >= 0) {
+        log_flush(log_fd, log_path, &seen);
+        if (close(log_fd) < 0) {
+            perror(log_path);
+            exit(EXIT_FAILURE);
+        }
+        free(ring.recs);
+        free(seen.slots);
+    }
+
+    Table *final = &tables[run % 2];
+    for (size_t i = 0; i < final->nslots; i++)
+        if (final->slots[i] != NULL)
+            proc_close(final->slots[i]);
+    free(tables[0].slots);
+    free(tables[1].slots);
+    free(list);
+    close(proc_fd);
+    return EXIT_SUCCESS;
+}
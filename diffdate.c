@@ -6,104 +6,589 @@
 #  Purpose        : To understand time and locale used in Linux
 #  Usage          : ./diffdate
 #  Build with     : ./diffdate date1 date2
-#  Modifications  :
+#                   ./diffdate --batch [-j threads] [--summary] [file]
+#                   Either form takes --stats.
+#  Modifications  : Added --batch, which reads one date or a pair of dates per line from stdin.
+#                   --batch parses with SSSE3 or AVX2 when the CPU has them. Days past the end
+#                   of a month are now checked against the month's real length, leap years included.
+#                   --batch can read a file with several threads, and --summary prints only totals.
+#                   Output goes through fastfmt.h, and the date arguments are compared as day numbers
+#                   instead of through mktime(), so the time of day no longer changes the answer.
+#                   Added --stats.
 */
 
-// Note: To compile, use -lm
+// Note: To compile, use -pthread
 
-#define _XOPEN_SOURCE
+/*
+With --batch every line of stdin is YYYY-MM-DD or YYYY-MM-DD YYYY-MM-DD, and the answer for
+each line is printed on its own line as a signed number of days: the second date minus the
+first, or the date minus today for a line with one date. A line that is not in that form or
+names a day that does not exist prints "invalid", so the output stays in step with the input,
+and the exit status is 1. The dates are parsed by position and turned into day numbers with
+integer arithmetic (days from civil, counting in 400-year eras of 146097 days), so no libc
+time function is called after today's date is looked up once. stdin is read and the answers
+are written in large blocks.
+
+On x86 the dates are parsed with vector instructions chosen when the program starts. SSSE3
+handles a date in one 16-byte register, and AVX2 handles both dates of a pair in one 32-byte
+register. Subtracting '0' from every byte and XORing the dash positions makes a valid date
+all small numbers, so one unsigned minimum against a per-byte limit checks every digit and
+dash at once. A shuffle gathers the eight digits, and two multiply-adds turn them into the
+year, month and day. Other CPUs use the scalar parser. Both parsers validate the day against a
+table of month lengths indexed by leap year and month, which needs no branches. The buffers
+have slack at the end, since the vector loads read past the line.
+
+Given a file, --batch maps it over a slightly larger block of zeroed anonymous memory, so the
+vector loads stay readable past its last line. The map is cut into 8 MiB chunks just after a
+newline, and -j threads answer chunks into their own buffers. The main thread writes the
+buffers in file order, and the threads stay at most two chunks per thread ahead of it. With
+--summary nothing is printed per line. Each chunk keeps a count, the minimum, maximum and sum,
+and a histogram of differences in power-of-two bins, and these are added up at the end.
+*/
+
+#define _GNU_SOURCE         // strptime(), and MAP_ANONYMOUS for --batch
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
-#include <math.h>
 #include <locale.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+#include "stats.h"
+#include "fastfmt.h"
+
+#define BATCH_IN   (1 << 20)
+#define BATCH_SLACK 32          // Readable bytes past the last line, for vector loads
+#define BATCH_CHUNK (8 << 20)   // Piece of a file given to one thread
+#define MAX_THREADS 256
+#define HIST_BINS   (2 * 24 + 1)    // Zero, and 24 powers of two each way
+
+// Days in each month, for common and leap years. Months 0 and 13 to 15 have none.
+static const unsigned char month_days[2][16] = {
+    { 0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31, 0, 0, 0 },
+    { 0, 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31, 0, 0, 0 },
+};
+
+// A year divisible by 100 is a leap year only if divisible by 400, that is, by 16 as well as 25.
+static inline unsigned is_leap(unsigned y) {
+    return (y & ((y % 25) ? 3 : 15)) == 0;
+}
 
-int check_for_letters(char* cmd, char* input){
-    char *endptr;
-    // Check to see if there are any letters in the date
-    long long val = strtoll(input, &endptr, 10);
-    if (*endptr != '\0' || errno == ERANGE) {
-        fprintf(stderr, "USAGE: %s [YYYY-MM-DD] [YYYY-MM-DD]\n", cmd);
-        exit(-1);
-    } else {
-        // No error
-        return 0;
+// Days since 1970-01-01 of a proleptic Gregorian date. Months are shifted to start in March,
+// so the leap day falls at the end of the year and the day of the year is a linear formula.
+static long days_from_civil(long y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long)doe - 719468;
+}
+
+// Day number of a date already split into digits, or -1 if there is no such day.
+static inline int civil_day(unsigned y, unsigned m, unsigned d, long *day) {
+    unsigned ok = (m - 1 < 12) & (d - 1 < month_days[is_leap(y)][m & 15]);
+
+    if (!ok)
+        return -1;
+    *day = days_from_civil(y, m, d);
+    return 0;
+}
+
+// Parse YYYY-MM-DD from the 10 bytes at p into a day number. Returns -1 if it is not a real date.
+static int parse_date_scalar(const char *p, long *day) {
+    unsigned bad = (p[4] != '-') | (p[7] != '-');
+    unsigned c[10];
+
+    for (int i = 0; i < 10; i++) {
+        c[i] = (unsigned char)p[i] - '0';
+        bad |= (i != 4 && i != 7) & (c[i] > 9);
     }
+    if (bad)
+        return -1;
+    return civil_day(c[0] * 1000 + c[1] * 100 + c[2] * 10 + c[3], c[5] * 10 + c[6],
+                     c[8] * 10 + c[9], day);
 }
 
-void compare_dates(struct tm d1, struct tm d2, int today){
-    time_t time1, time2;
+static int parse_pair_scalar(const char *p, long *d1, long *d2) {
+    return parse_date_scalar(p, d1) | parse_date_scalar(p + 11, d2);
+}
 
-    // mktime() converts struct tm into seconds as long int from EPOCH
-    time1 = mktime(&d1);
-    time2 = mktime(&d2);
-   // date1, today -> today - time1 = > 0
-    double diff = difftime(time1, time2); //time2 - time1
+#ifdef HAVE_X86_SIMD
+// After subtracting '0', a date's digits are 0..9 and its dashes are '-' - '0' = 0xFD.
+// XORing the dashes with 0xFD makes them 0, so a byte is valid if it is at most its limit.
+#define DATE_XOR   0, 0, 0, 0, (char)0xFD, 0, 0, (char)0xFD, 0, 0, 0, 0, 0, 0, 0, 0
+#define DATE_LIMIT 9, 9, 9, 9, 0, 9, 9, 0, 9, 9, -1, -1, -1, -1, -1, -1
+#define DATE_DIGITS 0, 1, 2, 3, 5, 6, 8, 9, -1, -1, -1, -1, -1, -1, -1, -1
+#define DATE_TENS  10, 1, 10, 1, 10, 1, 10, 1, 0, 0, 0, 0, 0, 0, 0, 0
+#define DATE_HUNDREDS 100, 1, 1, 0, 0, 0, 0, 0
+
+__attribute__((target("ssse3")))
+static int parse_date_ssse3(const char *p, long *day) {
+    __m128i t = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi8('0'));
+    __m128i x = _mm_xor_si128(t, _mm_setr_epi8(DATE_XOR));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, _mm_setr_epi8(DATE_LIMIT)), x)) != 0xFFFF)
+        return -1;
+
+    // Digit pairs become YY, YY, MM, DD, then the year's halves are joined
+    __m128i pairs = _mm_maddubs_epi16(_mm_shuffle_epi8(t, _mm_setr_epi8(DATE_DIGITS)),
+                                      _mm_setr_epi8(DATE_TENS));
+    __m128i ym = _mm_madd_epi16(pairs, _mm_setr_epi16(DATE_HUNDREDS));
+    return civil_day(_mm_cvtsi128_si32(ym), _mm_extract_epi16(ym, 2), _mm_extract_epi16(pairs, 3), day);
+}
 
-    int days = round(diff / 86400);
+__attribute__((target("ssse3")))
+static int parse_pair_ssse3(const char *p, long *d1, long *d2) {
+    return parse_date_ssse3(p, d1) | parse_date_ssse3(p + 11, d2);
+}
 
+// Both dates of a pair, one in each 128-bit half
+__attribute__((target("avx2")))
+static int parse_pair_avx2(const char *p, long *d1, long *d2) {
+    __m256i v = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)(p + 11)),
+                                 _mm_loadu_si128((const __m128i *)p));
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i x = _mm256_xor_si256(t, _mm256_setr_epi8(DATE_XOR, DATE_XOR));
+
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_setr_epi8(DATE_LIMIT, DATE_LIMIT)), x)) != -1)
+        return -1;
+
+    __m256i pairs = _mm256_maddubs_epi16(_mm256_shuffle_epi8(t, _mm256_setr_epi8(DATE_DIGITS, DATE_DIGITS)),
+                                         _mm256_setr_epi8(DATE_TENS, DATE_TENS));
+    __m256i ym = _mm256_madd_epi16(pairs, _mm256_setr_epi16(DATE_HUNDREDS, DATE_HUNDREDS));
+    return civil_day(_mm256_extract_epi32(ym, 0), _mm256_extract_epi16(ym, 2),
+                     _mm256_extract_epi16(pairs, 3), d1) |
+           civil_day(_mm256_extract_epi32(ym, 4), _mm256_extract_epi16(ym, 10),
+                     _mm256_extract_epi16(pairs, 11), d2);
+}
+#endif
+
+// The parsers for this CPU
+static int (*parse_date)(const char *p, long *day) = parse_date_scalar;
+static int (*parse_pair)(const char *p, long *d1, long *d2) = parse_pair_scalar;
+
+static void choose_parsers(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        parse_date = parse_date_ssse3;
+        parse_pair = parse_pair_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2"))
+        parse_pair = parse_pair_avx2;
+#endif
+}
 
-    // Create output buffer to store the date as MM DD, YYYY
-    char output1[30];
-    char output2[30];
-    strftime(output1, sizeof(output1), "%B %d, %Y", &d1);
-    strftime(output2, sizeof(output2), "%B %d, %Y", &d2);
+// Totals for --summary. Bin HIST_BINS / 2 counts zero, and the bins above and below it count
+// differences whose magnitude is in [2^k, 2^(k+1)).
+typedef struct {
+    long long count, invalid, sum;
+    long min, max;
+    long long hist[HIST_BINS];
+} Summary;
+
+static long today;          // Looked up once; every line is then plain integer arithmetic
+static int summary_only;
+
+static void answer(OutBuf *o, Summary *sum, long diff) {
+    if (summary_only) {
+        unsigned long mag = diff < 0 ? -(unsigned long)diff : (unsigned long)diff;
+        int bin = mag == 0 ? 0 : 64 - __builtin_clzl(mag);
+        sum->hist[HIST_BINS / 2 + (diff < 0 ? -bin : bin)]++;
+        sum->min = sum->count == 0 || diff < sum->min ? diff : sum->min;
+        sum->max = sum->count == 0 || diff > sum->max ? diff : sum->max;
+        sum->sum += diff;
+        sum->count++;
+        return;
+    }
+    char *end = put_ll(out_reserve(o, 24), diff);
+    *end++ = '\n';
+    o->used = end - o->buf;
+}
 
-    // When comparing days between today
-    if(1 == today){
+static void answer_invalid(OutBuf *o, Summary *sum) {
+    sum->invalid++;
+    if (summary_only)
+        return;
+    out_mem(o, "invalid\n", 8);
+}
 
-        if(days+1 > 0){
-            // after
-            strftime(output1, sizeof(output1), "%B %d, %Y", &d1);
+// Answer one line of len bytes, without its newline.
+static void batch_line(const char *p, size_t len, OutBuf *o, Summary *sum) {
+    long d1, d2;
+
+    if (len > 0 && p[len - 1] == '\r')
+        len--;
+    if (len == 10 && parse_date(p, &d1) == 0)
+        answer(o, sum, d1 - today);
+    else if (len == 21 && (p[10] == ' ' || p[10] == '\t') && parse_pair(p, &d1, &d2) == 0)
+        answer(o, sum, d2 - d1);
+    else
+        answer_invalid(o, sum);
+}
 
-            printf("%s is %d days after today\n", output1, abs(days+1));
+// Answer the lines in [p, end), which must have BATCH_SLACK readable bytes after it. A last
+// line without a newline is answered only at end of input. Returns where it stopped.
+static const char *batch_lines(const char *p, const char *end, int at_eof, OutBuf *o, Summary *sum) {
+    for (;;) {
+        // Pairs have a fixed length, and one that parses has no newline inside it
+        long d1, d2;
+        if (end - p > 21 && p[21] == '\n' && (p[10] == ' ' || p[10] == '\t') &&
+            parse_pair(p, &d1, &d2) == 0) {
+            answer(o, sum, d2 - d1);
+            p += 22;
+            continue;
+        }
 
-        } else if(0 == abs(days+1)){
-            strftime(output1, sizeof(output1), "%B %d, %Y", &d1);
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL && (!at_eof || p == end))
+            return p;
+        batch_line(p, (nl != NULL ? nl : end) - p, o, sum);
+        p = nl != NULL ? nl + 1 : end;
+    }
+}
 
-            printf("%s is the same as %s\n", output1, output1);
-        } else {
+// Answer every line read from fd, which is stdin unless a file could not be mapped.
+static void batch_stream(int fd, Summary *sum) {
+    static char in[BATCH_IN + BATCH_SLACK];
+    OutBuf o;
+    size_t have = 0;
+    int eof = 0;
+
+    out_init(&o, STDOUT_FILENO);
+    while (!eof || have > 0) {
+        if (!eof) {
+            ssize_t n = read(fd, in + have, BATCH_IN - have);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("read");
+                exit(EXIT_FAILURE);
+            }
+            eof = n == 0;
+            have += n;
+        }
 
-            // before
-            strftime(output1, sizeof(output1), "%B %d, %Y", &d1);
+        char *end = in + have;
+        char *p = (char *)batch_lines(in, end, eof, &o, sum);
+
+        // A line longer than the buffer is not a date line; drop it and carry on
+        if (p == in && have == BATCH_IN) {
+            char *nl;
+            do {
+                ssize_t n = read(fd, in, BATCH_IN);
+                if (n <= 0) {
+                    eof = 1;
+                    break;
+                }
+                nl = memchr(in, '\n', n);
+                have = n;
+            } while (nl == NULL);
+            answer_invalid(&o, sum);
+            p = eof ? in + have : nl + 1;
+            end = in + have;
+        }
+        memmove(in, p, end - p);
+        have = end - p;
+    }
+    if (out_close(&o) < 0) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void merge_summary(Summary *into, const Summary *from) {
+    if (from->count > 0) {
+        into->min = into->count == 0 || from->min < into->min ? from->min : into->min;
+        into->max = into->count == 0 || from->max > into->max ? from->max : into->max;
+    }
+    into->count += from->count;
+    into->invalid += from->invalid;
+    into->sum += from->sum;
+    for (int i = 0; i < HIST_BINS; i++)
+        into->hist[i] += from->hist[i];
+}
+
+// One piece of a mapped file, cut at a line boundary
+typedef struct {
+    const char *start, *end;
+    OutBuf out;
+    Summary sum;
+    int done;
+} Chunk;
+
+static struct {
+    Chunk *chunks;
+    size_t nchunks;
+    size_t next;            // Next chunk to hand out
+    size_t written;         // Chunks already written, in order
+    int window;             // How far ahead of the writer the workers may get
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} work = { NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void *batch_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&work.lock);
+        while (work.next < work.nchunks && work.next >= work.written + work.window)
+            pthread_cond_wait(&work.cond, &work.lock);
+        size_t i = work.next++;
+        pthread_mutex_unlock(&work.lock);
+        if (i >= work.nchunks)
+            return NULL;
+
+        Chunk *c = &work.chunks[i];
+        out_init(&c->out, -1);
+        batch_lines(c->start, c->end, 1, &c->out, &c->sum);
+
+        pthread_mutex_lock(&work.lock);
+        c->done = 1;
+        pthread_cond_broadcast(&work.cond);
+        pthread_mutex_unlock(&work.lock);
+    }
+}
+
+// Answer every line of a file with nthreads threads, writing the answers in order.
+static void batch_file(const char *path, int nthreads, Summary *sum) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (S_ISREG(st.st_mode) && st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    // The file goes over zeroed anonymous memory, so vector loads past its end stay readable.
+    // A pipe or device has no size to map, and is read as stdin would be, as is a file that
+    // cannot be mapped.
+    size_t size = st.st_size;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t span = (size + BATCH_SLACK + page - 1) / page * page;
+    char *base = S_ISREG(st.st_mode) ? mmap(NULL, span, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if (base != MAP_FAILED && mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, span);
+        base = MAP_FAILED;
+    }
+    if (base == MAP_FAILED) {
+        stats_phase("answer");
+        batch_stream(fd, sum);
+        close(fd);
+        return;
+    }
+    close(fd);
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    // Cut into chunks just after a newline
+    stats_phase("map");
+    size_t cap = size / BATCH_CHUNK + 2;
+    if ((work.chunks = calloc(cap, sizeof(Chunk))) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    const char *p = base, *end = base + size;
+    while (p < end) {
+        const char *cut = end - p > BATCH_CHUNK ? p + BATCH_CHUNK : end;
+        if (cut < end) {
+            const char *nl = memchr(cut, '\n', end - cut);
+            cut = nl != NULL ? nl + 1 : end;
+        }
+        work.chunks[work.nchunks].start = p;
+        work.chunks[work.nchunks].end = cut;
+        work.nchunks++;
+        p = cut;
+    }
+    work.window = 2 * nthreads;
+    stats_phase("answer");
+
+    pthread_t tids[MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, batch_worker, NULL) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < work.nchunks; i++) {
+        Chunk *c = &work.chunks[i];
+        pthread_mutex_lock(&work.lock);
+        while (!c->done)
+            pthread_cond_wait(&work.cond, &work.lock);
+        pthread_mutex_unlock(&work.lock);
+
+        if (write_all(STDOUT_FILENO, c->out.buf, c->out.used) < 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        out_close(&c->out);
+        merge_summary(sum, &c->sum);
+
+        pthread_mutex_lock(&work.lock);
+        work.written++;
+        pthread_cond_broadcast(&work.cond);
+        pthread_mutex_unlock(&work.lock);
+    }
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    free(work.chunks);
+    munmap(base, span);
+}
+
+static void print_summary(const Summary *sum) {
+    printf("lines:   %lld\n", sum->count + sum->invalid);
+    printf("invalid: %lld\n", sum->invalid);
+    if (sum->count == 0)
+        return;
+    printf("min:     %ld\n", sum->min);
+    printf("max:     %ld\n", sum->max);
+    printf("mean:    %.3f\n", (double)sum->sum / sum->count);
+    printf("days:\n");
+    for (int i = 0; i < HIST_BINS; i++) {
+        int bin = i - HIST_BINS / 2;
+        long lo = bin == 0 ? 0 : 1L << (labs(bin) - 1), hi = bin == 0 ? 0 : (1L << labs(bin)) - 1;
+        if (sum->hist[i] == 0)
+            continue;
+        if (bin < 0)
+            printf("  %8ld .. %8ld  %lld\n", -hi, -lo, sum->hist[i]);
+        else
+            printf("  %8ld .. %8ld  %lld\n", lo, hi, sum->hist[i]);
+    }
+}
 
-            printf("%s was %d days before today\n", output1, abs(days+1));
+// diffdate --batch [-j threads] [--summary] [file]. Returns 1 if any line was invalid.
+static int run_batch(int argc, char *argv[]) {
+    int nthreads = 1;
+    int opt;
+
+    static struct option long_options[] = {
+        { "jobs",    required_argument, NULL, 'j' },
+        { "summary", no_argument,       NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "j:s", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'j':
+                nthreads = atoi(optarg);
+                if (nthreads < 1 || nthreads > MAX_THREADS) {
+                    fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                summary_only = 1;
+                break;
+            default:
+                fprintf(stderr, "USAGE: %s --batch [-j threads] [--summary] [file]\n", argv[0]);
+                exit(EXIT_FAILURE);
         }
+    }
+    if (argc - optind > 1) {
+        fprintf(stderr, "USAGE: %s --batch [-j threads] [--summary] [file]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    time_t now = time(NULL);
+    struct tm *tm = localtime(&now);
+    today = days_from_civil(tm->tm_year + 1900L, tm->tm_mon + 1, tm->tm_mday);
+    choose_parsers();
+
+    // stdin cannot be mapped, so it is read by one thread
+    Summary sum;
+    memset(&sum, 0, sizeof(sum));
+    if (argc - optind == 1 && strcmp(argv[optind], "-") != 0) {
+        batch_file(argv[optind], nthreads, &sum);
     } else {
-        // Comparing two different days
-        if(days > 0){
-            // before
-            strftime(output1, sizeof(output1), "%B %d, %Y", &d1);
-            strftime(output2, sizeof(output2), "%B %d, %Y", &d2);
+        stats_phase("answer");
+        batch_stream(STDIN_FILENO, &sum);
+    }
 
-            printf("%s was %d days before %s\n", output2, abs(days), output1);
+    if (summary_only) {
+        stats_phase("summary");
+        print_summary(&sum);
+        fflush(stdout);
+    }
+    return sum.invalid != 0;
+}
 
-        } else if(0 == days){
-            strftime(output1, sizeof(output1), "%B %d, %Y", &d1);
+void compare_dates(struct tm d1, struct tm d2, int today){
+    OutBuf out;
 
-            printf("%s is the same as %s\n", output1, output1);
-        } else {
+    // Both dates become day numbers, so the difference is exact whatever the time of day
+    long days = days_from_civil(d1.tm_year + 1900L, d1.tm_mon + 1, d1.tm_mday) -
+                days_from_civil(d2.tm_year + 1900L, d2.tm_mon + 1, d2.tm_mday);
 
-            // after
-            strftime(output1, sizeof(output1), "%B %d, %Y", &d1);
-            strftime(output2, sizeof(output2), "%B %d, %Y", &d2);
+    stats_phase("output");
+    out_init(&out, STDOUT_FILENO);
 
-            printf("%s is %d days after %s\n", output2, abs(days), output1);
+    // Dates are written as Month DD, YYYY in the user's locale
+    if(1 == today){
+        // When comparing days between today
+        out_date(&out, d1.tm_year + 1900LL, d1.tm_mon + 1, d1.tm_mday);
+        if(days > 0){
+            // after
+            out_str(&out, " is ");
+            out_ll(&out, days);
+            out_str(&out, " days after today\n");
+        } else if(0 == days){
+            out_str(&out, " is the same as ");
+            out_date(&out, d1.tm_year + 1900LL, d1.tm_mon + 1, d1.tm_mday);
+            out_char(&out, '\n');
+        } else {
+            // before
+            out_str(&out, " was ");
+            out_ll(&out, -days);
+            out_str(&out, " days before today\n");
         }
+    } else if(0 == days){
+        out_date(&out, d1.tm_year + 1900LL, d1.tm_mon + 1, d1.tm_mday);
+        out_str(&out, " is the same as ");
+        out_date(&out, d1.tm_year + 1900LL, d1.tm_mon + 1, d1.tm_mday);
+        out_char(&out, '\n');
+    } else {
+        // Comparing two different days: before when the first is later, otherwise after
+        out_date(&out, d2.tm_year + 1900LL, d2.tm_mon + 1, d2.tm_mday);
+        out_str(&out, days > 0 ? " was " : " is ");
+        out_ll(&out, days > 0 ? days : -days);
+        out_str(&out, days > 0 ? " days before " : " days after ");
+        out_date(&out, d1.tm_year + 1900LL, d1.tm_mon + 1, d1.tm_mday);
+        out_char(&out, '\n');
+    }
+
+    if (out_close(&out) < 0) {
+        perror("write");
+        exit(EXIT_FAILURE);
     }
 }
 
 int main(int argc, char *argv[]) {
+    stats_init(&argc, argv);
+    stats_phase("parse");
     setlocale(LC_ALL, "");
 
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0)
+        return run_batch(argc - 1, argv + 1);
+
     if(argc == 1) {
         fprintf(stderr, "USAGE: %s [YYYY-MM-DD] [YYYY-MM-DD] \nNot enough arguments\n", argv[0]);
     }
 
-    int flag; // Flag is for edge case for any month that has less than 31 days
-
     // Check for errors in the arguments
     for(int i=1; i < argc ; i++){
         char date_copy[strlen(argv[i]) + 1];
@@ -112,59 +597,47 @@ int main(int argc, char *argv[]) {
         char *token = strtok(date_copy, "-");
 
         int j = 0;
+        long year = 0, month = 0;
         while (token != NULL) {
+            // Each part is converted once, and anything after its digits, like a letter, is an error
+            char *end;
+            errno = 0;
+            long value = strtol(token, &end, 10);
+            if (*end != '\0' || errno == ERANGE) {
+                fprintf(stderr, "USAGE: %s [YYYY-MM-DD] [YYYY-MM-DD]\n", argv[0]);
+                exit(-1);
+            }
 
             if(j == 0) {
                 // Year can be any number
-                if(atoi(token) == 0){
-                    // Check if there is invalid date due to characters
-                    check_for_letters(argv[0], token);
-                    printf("%s\n", token);
-                }
+                year = value;
 
             } else if (j == 1) {
-                check_for_letters(argv[0], token);
                 // Month: 1-12
 
-                if(atoi(token) < 1 || atoi(token) > 12){
+                if(value < 1 || value > 12){
                     fprintf(stderr, "USAGE: %s [YYYY-MM-DD] [YYYY-MM-DD].\n Month can only be between 01 (Jan) to 12 (Dec)\n", argv[0]);
                     exit(-1);
-                    printf("%s\n", token);
-                }
-
-                if(atoi(token) == 2){
-                    // Month of Febraury
-                    flag = 0;
-                }
-                if( atoi(token) == 4 || atoi(token) == 6 || atoi(token) == 9 || atoi(token) == 11 ){
-                    // April, June, September, November
-                    flag = 1;
                 }
+                month = value;
 
             } else if (j == 2) {
-                check_for_letters(argv[0], token);
-
                 // Date: 1-31
-                if(atoi(token) < 1 || atoi(token) > 31){
+                if(value < 1 || value > 31){
                     fprintf(stderr, "USAGE: %s [YYYY-MM-DD] [YYYY-MM-DD].\n Date can only be between 01 to 31\n", argv[0]);
                     exit(-1);
                 }
 
-
-                if(0 == flag){
-                    if(atoi(token) > 29){
-                        fprintf(stderr, "USAGE: %s [YYYY-MM-DD] [YYYY-MM-DD].\n Month of February only has 28 or 29 days.\n", argv[0]);
-                        exit(-1);
-                    }
-                }
-                if(1 == flag){
-
-                    if(atoi(token) > 30) {
+                // The real length of the month, which for February depends on the year
+                if(value > month_days[is_leap((unsigned)year)][month & 15]){
+                    if(month == 2){
+                        fprintf(stderr, "USAGE: %s [YYYY-MM-DD] [YYYY-MM-DD].\n February %ld only has %d days.\n", argv[0],
+                                year, month_days[is_leap((unsigned)year)][2]);
+                    } else {
                         fprintf(stderr, "USAGE: %s [YYYY-MM-DD] [YYYY-MM-DD].\n April, June, September, and November only have 30 days.\n", argv[0]);
-                        exit(-1);
                     }
+                    exit(-1);
                 }
-            flag = -1;
 
             } else {
                 fprintf(stderr, "USAGE: %s [YYYY-MM-DD] [YYYY-MM-DD]. \nToo many arguments.\n", argv[0]);
@@ -177,10 +650,11 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    struct tm date1;
+    // strptime() only fills in the fields it parses, so the rest must start out cleared
+    struct tm date1 = { .tm_isdst = -1 };
 
     if(argc == 3){
-        struct tm date2;
+        struct tm date2 = { .tm_isdst = -1 };
         if (strptime(argv[1], "%Y-%m-%d", &date1) == NULL) {
             fprintf(stderr, "Invalid date format for date1: %s\n", argv[1]);
             return -1;
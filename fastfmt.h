@@ -0,0 +1,288 @@
+/*
+#  Title          : fastfmt.h
+#  Author         : Brandon Cohen
+#  Created on     : December 20, 2023
+#  Description    : Buffered output and integer and date formatting shared by the programs here.
+#  Purpose        : To keep printing from costing more than the work being printed.
+#  Usage          : #include "fastfmt.h"
+#  Build with     : Nothing extra; every function is static inline in this header.
+#  Modifications  :
+*/
+
+/*
+Calling printf once per line parses its format string every time, and going through stdio
+copies the text a second time before it reaches write(). The programs here print a lot of
+short lines made of names, numbers and dates, so instead they put the text straight into an
+OutBuf. Given a file descriptor, an OutBuf hands its contents to write() in one call whenever
+it fills up, and once more at the end. Given -1 it grows instead, so a thread can build its
+part of the output and another thread can write the parts in order.
+
+Numbers are written two digits per division, with the pair looked up in a 200-byte table.
+Dates are the slow part of printf-style output, because localtime() works out the calendar
+and the time zone again for every call. out_ctime() keeps the date and hour of the last time
+it was given, so a later time in the same hour only needs its minutes and seconds worked out.
+Most time zone changes happen on the hour, but not all of them: the end of local mean time and
+some old changes fall at odd minutes. So the hour is only kept when the offset from UTC is the
+same at both its ends, and otherwise only that one second is. out_date() looks up
+the month names of the current locale once and then writes the date with no library calls.
+Neither cache is locked, so each is meant to be used from one thread.
+*/
+
+#ifndef FASTFMT_H
+#define FASTFMT_H
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OUT_SIZE (1 << 16)      // Bytes an OutBuf holds before it is written
+
+// Text waiting to be written to fd, or kept in memory when fd is -1
+typedef struct {
+    char *buf;
+    size_t used, cap;
+    int fd;
+    int err;                    // errno of the first failed write; later output is dropped
+} OutBuf;
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Write u in decimal at p and return the position after the last digit.
+static inline char *put_ull(char *p, unsigned long long u) {
+    char tmp[20];
+    char *t = tmp + sizeof(tmp);
+
+    // Two digits per division
+    while (u >= 100) {
+        unsigned r = u % 100;
+        u /= 100;
+        t -= 2;
+        memcpy(t, digit_pairs + 2 * r, 2);
+    }
+    if (u >= 10) {
+        t -= 2;
+        memcpy(t, digit_pairs + 2 * u, 2);
+    } else {
+        *--t = (char)('0' + u);
+    }
+
+    size_t len = tmp + sizeof(tmp) - t;
+    memcpy(p, t, len);
+    return p + len;
+}
+
+static inline char *put_ll(char *p, long long v) {
+    if (v < 0) {
+        *p++ = '-';
+        return put_ull(p, -(unsigned long long)v);
+    }
+    return put_ull(p, (unsigned long long)v);
+}
+
+// Write v as exactly two digits, for values 0 to 99.
+static inline char *put_2d(char *p, unsigned v) {
+    memcpy(p, digit_pairs + 2 * v, 2);
+    return p + 2;
+}
+
+// Write all len bytes, retrying short writes. Returns -1 with errno set if write() fails.
+static inline int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Set up out to write to fd, or to grow in memory when fd is -1.
+static inline void out_init(OutBuf *out, int fd) {
+    out->used = 0;
+    out->cap = OUT_SIZE;
+    out->fd = fd;
+    out->err = 0;
+    if ((out->buf = malloc(out->cap)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Write what is buffered. Returns -1 if this or an earlier write failed, with errno set.
+static inline int out_flush(OutBuf *out) {
+    if (out->fd < 0)
+        return 0;
+    if (out->used > 0 && !out->err) {
+        if (write_all(out->fd, out->buf, out->used) < 0)
+            out->err = errno;
+    }
+    out->used = 0;
+    errno = out->err;
+    return out->err ? -1 : 0;
+}
+
+// Flush out and free its buffer. Returns -1 if any write failed.
+static inline int out_close(OutBuf *out) {
+    int rc = out_flush(out);
+    free(out->buf);
+    out->buf = NULL;
+    return rc;
+}
+
+// Make room for n more bytes and return where they go. The caller adds n to out->used.
+static inline char *out_reserve(OutBuf *out, size_t n) {
+    if (out->cap - out->used < n) {
+        if (out->fd >= 0)
+            out_flush(out);
+        if (out->cap - out->used < n) {
+            while (out->cap - out->used < n)
+                out->cap *= 2;
+            if ((out->buf = realloc(out->buf, out->cap)) == NULL) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    return out->buf + out->used;
+}
+
+static inline void out_mem(OutBuf *out, const void *s, size_t len) {
+    memcpy(out_reserve(out, len), s, len);
+    out->used += len;
+}
+
+static inline void out_str(OutBuf *out, const char *s) {
+    out_mem(out, s, strlen(s));
+}
+
+static inline void out_char(OutBuf *out, char c) {
+    *out_reserve(out, 1) = c;
+    out->used++;
+}
+
+static inline void out_ull(OutBuf *out, unsigned long long u) {
+    out->used = put_ull(out_reserve(out, 20), u) - out->buf;
+}
+
+static inline void out_ll(OutBuf *out, long long v) {
+    out->used = put_ll(out_reserve(out, 21), v) - out->buf;
+}
+
+// Format with vsnprintf, for the odd format that has no faster path.
+static inline void out_printf(OutBuf *out, const char *fmt, ...) {
+    va_list ap;
+    char *p = out_reserve(out, 128);
+
+    va_start(ap, fmt);
+    int n = vsnprintf(p, out->cap - out->used, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    // Too long for the room there was, so make enough and format again
+    if ((size_t)n >= out->cap - out->used) {
+        p = out_reserve(out, n + 1);
+        va_start(ap, fmt);
+        vsnprintf(p, n + 1, fmt, ap);
+        va_end(ap);
+    }
+    out->used += n;
+}
+
+// Write t as ctime() does, "Thu Dec 14 09:05:03 2023\n", in local time.
+static inline void out_ctime(OutBuf *out, time_t t) {
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    static time_t hour_start;
+    static time_t valid_from = 1, valid_to = 0;   // Times the cache is right for, empty at first
+    static char head[16];       // "Thu Dec 14 09:"
+    static char year[24];       // " 2023\n"
+    static size_t head_len, year_len;
+
+    if (t < valid_from || t >= valid_to) {
+        struct tm tm;
+        if (localtime_r(&t, &tm) == NULL) {
+            out_str(out, "??? ??? ?? ??:??:?? ????\n");
+            return;
+        }
+
+        char *p = head;
+        memcpy(p, days + 3 * tm.tm_wday, 3);
+        p[3] = ' ';
+        memcpy(p + 4, months + 3 * tm.tm_mon, 3);
+        p[7] = ' ';
+        p[8] = tm.tm_mday < 10 ? ' ' : (char)('0' + tm.tm_mday / 10);
+        p[9] = (char)('0' + tm.tm_mday % 10);
+        p[10] = ' ';
+        p = put_2d(p + 11, tm.tm_hour);
+        *p++ = ':';
+        head_len = p - head;
+
+        p = year;
+        *p++ = ' ';
+        p = put_ll(p, tm.tm_year + 1900LL);
+        *p++ = '\n';
+        year_len = p - year;
+
+        hour_start = t - (tm.tm_min * 60 + tm.tm_sec);
+        valid_from = hour_start;
+        valid_to = hour_start + 3600;
+
+        // A change of offset within the hour makes the cache good for this second only
+        struct tm first, last;
+        time_t end = valid_to - 1;
+        if (localtime_r(&valid_from, &first) == NULL || localtime_r(&end, &last) == NULL ||
+            first.tm_gmtoff != tm.tm_gmtoff || last.tm_gmtoff != tm.tm_gmtoff) {
+            valid_from = t;
+            valid_to = t + 1;
+        }
+    }
+
+    unsigned s = (unsigned)(t - hour_start);
+    char *p = out_reserve(out, head_len + 6 + year_len);
+    memcpy(p, head, head_len);
+    p = put_2d(p + head_len, s / 60);
+    *p++ = ':';
+    p = put_2d(p, s % 60);
+    memcpy(p, year, year_len);
+    out->used = p + year_len - out->buf;
+}
+
+// Write a date as strftime's "%B %d, %Y" does, like "March 05, 2024", in the current locale.
+static inline void out_date(OutBuf *out, long long year, int month, int day) {
+    static char names[12][64];
+    static size_t lens[12];
+    static int loaded;
+
+    // The month names are looked up once, after the program has set its locale
+    if (!loaded) {
+        for (int m = 0; m < 12; m++) {
+            struct tm tm = { .tm_mon = m, .tm_mday = 1, .tm_year = 100 };
+            lens[m] = strftime(names[m], sizeof(names[m]), "%B", &tm);
+        }
+        loaded = 1;
+    }
+
+    char *p = out_reserve(out, lens[month - 1] + 28);
+    memcpy(p, names[month - 1], lens[month - 1]);
+    p += lens[month - 1];
+    *p++ = ' ';
+    p = put_2d(p, day);
+    *p++ = ',';
+    *p++ = ' ';
+    p = put_ll(p, year);
+    out->used = p - out->buf;
+}
+
+#endif
@@ -4,9 +4,10 @@
 #  Created on     : December 13, 2023
 #  Description    : A C program that prints sorted stat member in increasing or decreasing order.
 #  Purpose        : To become more familair with statx
-#  Usage          : ./fcompare [-abcmsu] [-lr] files ...
+#  Usage          : ./fcompare [-abcmsu] [-lr] [--stats] files ...
 #  Build with     : gcc fcompare.c -o fcompare
-#  Modifications  :
+#  Modifications  : Output is buffered through fastfmt.h, and sizes over 2 GiB are no longer cut to an int.
+#                   Added --stats, which also reports how long each statx() call took.
 */
 
 // Note: I used some code from the showstat.c program.
@@ -53,6 +54,8 @@ that I need. This would have saved me time from typing in stat for every file.
 #include <getopt.h>
 #include <fcntl.h>
 #include <locale.h>
+#include "stats.h"
+#include "fastfmt.h"
 
 
 // Array to hold the file name and its data
@@ -67,17 +70,20 @@ typedef struct {
 int compare_num(const void *a, const void *b) {
     Files *fileA = (Files *)a;
     Files *fileB = (Files *)b;
-    return (fileA->num - fileB->num);
+    return (fileA->num > fileB->num) - (fileA->num < fileB->num);
 }
 
 // Comparison function for qsort for time_t
 int compare_date(const void *a, const void *b) {
     Files *fileA = (Files *)a;
     Files *fileB = (Files *)b;
-    return (fileA->date - fileB->date);
+    return (fileA->date > fileB->date) - (fileA->date < fileB->date);
 }
 
 int main(int argc, char *argv[]) {
+    stats_init(&argc, argv);
+    stats_phase("parse");
+
     if (argc < 2) {
         fprintf(stderr, "Usage: %s file\n", argv[0]);
         return 1;
@@ -154,6 +160,8 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    stats_phase("stat");
+
     // Option a was chosen
     if (1 == opt_a) {
         // Option a (access time) and look at target of symbolic link
@@ -432,35 +440,43 @@ int main(int argc, char *argv[]) {
     }
 
 
+    // The lines are buffered and written together
+    OutBuf out;
+    out_init(&out, STDOUT_FILENO);
+
     if(opt_a > 0 || opt_b > 0 || opt_c > 0 || opt_m > 0){
+        stats_phase("sort");
         qsort(files, i, sizeof(Files), compare_date);
-
-        if(0 == opt_r){
-            for (int j = 0; j < i; j++) {
-                printf("%s %s", files[j].str, ctime((time_t*)&files[j].date) );
-            }
-        } else {
-            for (int j = i-1; j >= 0; j--) {
-                printf("%s %s", files[j].str, ctime((time_t*)&files[j].date) );
-            }
+        stats_phase("output");
+
+        // Times print as ctime() prints them, from a cache of the last hour seen
+        for (int k = 0; k < i; k++) {
+            int j = (0 == opt_r) ? k : i - 1 - k;
+            out_str(&out, files[j].str);
+            out_char(&out, ' ');
+            out_ctime(&out, files[j].date);
         }
     }
 
     if(opt_s > 0 || opt_u > 0){
+        stats_phase("sort");
         qsort(files, i, sizeof(Files), compare_num);
-
-        if(0 == opt_r){
-            for (int j = 0; j < i; j++) {
-                printf("%s %d\n", files[j].str, (int)files[j].num );
-            }
-        } else {
-            for (int j = i-1; j >= 0; j--) {
-                printf("%s %d\n", files[j].str, (int)files[j].num );
-            }
+        stats_phase("output");
+
+        for (int k = 0; k < i; k++) {
+            int j = (0 == opt_r) ? k : i - 1 - k;
+            out_str(&out, files[j].str);
+            out_char(&out, ' ');
+            out_ll(&out, files[j].num);
+            out_char(&out, '\n');
         }
     }
 
     free(files);
 
+    if (out_close(&out) < 0) {
+        perror("write");
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file
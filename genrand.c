@@ -0,0 +1,586 @@
+/*
+#  Title          : genrand.c
+#  Author         : Brandon Cohen
+#  Created on     : October 2, 2023
+#  Description    : A C program that writes the numbers from 1 to N, randomly shuffled, one per line to a file.
+#  Purpose        : A native replacement for genrand.sh, which appends each line separately and then runs shuf.
+#  Usage          : ./genrand [--seed S] [-j threads] [--stream] [--stats] [N] [filename]
+#  Build with     : gcc -O2 -pthread genrand.c -o genrand
+#  Modifications  : Added --stream, which writes the shuffle without holding it in memory.
+#                   Added -j. The in-memory shuffle is now a bucket scatter followed by a
+#                   Fisher-Yates shuffle of each bucket, which threads can share.
+#                   Added --stats.
+#                   Numbers are formatted with put_ull() from fastfmt.h instead of a copy of it.
+*/
+
+/*
+The permutation is built in memory from generators driven by xoshiro256**. Each number is sent
+to a random bucket, and then each bucket is shuffled with Fisher-Yates. Bounded random numbers
+use Lemire's multiply-and-reject method, so every index is equally likely without a division
+per draw. Every chunk and bucket has its own generator, derived from the seed and its index.
+With -j the chunks and buckets are shared out between threads, and the same seed still gives
+the same file for any thread count. The shuffled numbers are formatted into large buffers that
+are written to the file in order.
+
+With --stream nothing is stored. Position i of the output is a keyed Feistel network applied
+to i, which is a bijection on a power-of-four range covering N. Values that land past N are
+fed through the network again (cycle walking) until they fall inside, which keeps it a
+bijection on [0, N) and takes fewer than four tries on average. Memory use is the same for
+any N, so files larger than RAM can be written.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+#include "fastfmt.h"
+
+#define OUT_BUF_SIZE (1 << 22)  // Bytes formatted before each write
+#define MAX_LINE_LEN 21         // 20 digits and the newline
+#define FEISTEL_ROUNDS 8
+#define GEN_CHUNKS   64         // Scatter tasks; fixed so the output does not depend on -j
+#define BUCKET_NUMS  65536      // Numbers per bucket the bucket count aims for
+#define MAX_BUCKETS  65536
+#define MAX_THREADS  256
+
+// xoshiro256** state
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rng_next(Rng *r) {
+    uint64_t *s = r->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+// Expand a 64-bit seed into the full state with splitmix64, as the xoshiro authors suggest.
+static void rng_seed(Rng *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        r->s[i] = z ^ (z >> 31);
+    }
+}
+
+// Uniform number in [0, n), without modulo bias.
+static inline uint64_t rng_below(Rng *r, uint64_t n) {
+    unsigned __int128 m = (unsigned __int128)rng_next(r) * n;
+    uint64_t low = (uint64_t)m;
+
+    // Only a few values of the low half are over-represented; redraw those
+    if (low < n) {
+        uint64_t threshold = -n % n;
+        while (low < threshold) {
+            m = (unsigned __int128)rng_next(r) * n;
+            low = (uint64_t)m;
+        }
+    }
+    return (uint64_t)(m >> 64);
+}
+
+// splitmix64 finalizer, used as the Feistel round function and to derive generator streams
+static inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Keyed permutation of [0, n) built from a balanced Feistel network
+typedef struct {
+    uint64_t n;
+    int half_bits;
+    uint64_t mask;                      // Low half_bits set
+    uint64_t keys[FEISTEL_ROUNDS];
+} Feistel;
+
+static void feistel_init(Feistel *f, uint64_t n, Rng *rng) {
+    f->n = n;
+    f->half_bits = 1;
+    while (f->half_bits < 32 && (n - 1) >> (2 * f->half_bits) != 0)
+        f->half_bits++;
+    f->mask = (1ULL << f->half_bits) - 1;
+    for (int i = 0; i < FEISTEL_ROUNDS; i++)
+        f->keys[i] = rng_next(rng);
+}
+
+// One pass of the network over the full 2 * half_bits range.
+static inline uint64_t feistel_encrypt(const Feistel *f, uint64_t x) {
+    uint64_t l = x >> f->half_bits;
+    uint64_t r = x & f->mask;
+
+    for (int i = 0; i < FEISTEL_ROUNDS; i++) {
+        uint64_t t = l ^ (mix64(r ^ f->keys[i]) & f->mask);
+        l = r;
+        r = t;
+    }
+    return (l << f->half_bits) | r;
+}
+
+// Image of i in [0, n). Walks the cycle until the value is back inside the range.
+static inline uint64_t feistel_permute(const Feistel *f, uint64_t i) {
+    do {
+        i = feistel_encrypt(f, i);
+    } while (i >= f->n);
+    return i;
+}
+
+// In-memory shuffle, split into tasks that threads can run in any order
+typedef struct Shuffle Shuffle;
+typedef void (*task_fn)(Shuffle *sh, uint64_t task);
+
+// One output buffer. Bucket b is formatted into slot b % nslots.
+typedef struct {
+    char *buf;
+    size_t len;
+    uint64_t bucket;    // Bucket this slot is waiting for or holds
+    int ready;          // Bucket has been formatted and not yet written
+} Slot;
+
+struct Shuffle {
+    uint64_t n, seed;
+    uint64_t nbuckets;
+    void *perm;                 // uint32_t or uint64_t numbers, grouped by bucket
+    uint64_t *offsets;          // [chunk][bucket] next free place for that chunk's numbers
+    uint64_t *bucket_start;     // nbuckets + 1 entries
+    task_fn scatter_count, scatter, shuffle_bucket;
+    size_t (*format_bucket)(Shuffle *sh, uint64_t bucket, char *out);
+
+    // Task queue for the current phase
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    task_fn task;
+    uint64_t next_task, ntasks;
+
+    // Ordered output
+    int fd;
+    int nslots;
+    Slot *slots;
+    int failed;
+};
+
+// Independent generator for one chunk or bucket. Streams depend only on the
+// seed and the task number, never on which thread runs the task.
+static void rng_stream(Rng *r, uint64_t seed, uint64_t stream) {
+    rng_seed(r, seed ^ mix64(stream + 0x9e3779b97f4a7c15ULL));
+}
+
+// First and one past last number index of a scatter chunk
+static inline uint64_t chunk_begin(const Shuffle *sh, uint64_t c) {
+    return (uint64_t)((unsigned __int128)sh->n * c / GEN_CHUNKS);
+}
+
+// Bucket for the next number. nbuckets is a power of two, so this is unbiased.
+static inline uint64_t pick_bucket(Rng *r, uint64_t nbuckets) {
+    return (uint64_t)(((unsigned __int128)rng_next(r) * nbuckets) >> 64);
+}
+
+// Count how many numbers of chunk c go to each bucket.
+static void scatter_count(Shuffle *sh, uint64_t c) {
+    uint64_t *counts = sh->offsets + c * sh->nbuckets;
+    uint64_t end = chunk_begin(sh, c + 1);
+    Rng r;
+
+    rng_stream(&r, sh->seed, c);
+    for (uint64_t i = chunk_begin(sh, c); i < end; i++)
+        counts[pick_bucket(&r, sh->nbuckets)]++;
+}
+
+// Per element type: drop each number of a chunk into its bucket (replaying the
+// same choices as scatter_count), Fisher-Yates shuffle one bucket, and format one bucket.
+#define DEFINE_SHUFFLE_OPS(suffix, T)                                       \
+static void scatter_##suffix(Shuffle *sh, uint64_t c) {                     \
+    T *perm = sh->perm;                                                     \
+    uint64_t *offsets = sh->offsets + c * sh->nbuckets;                     \
+    uint64_t end = chunk_begin(sh, c + 1);                                  \
+    Rng r;                                                                  \
+    rng_stream(&r, sh->seed, c);                                            \
+    for (uint64_t i = chunk_begin(sh, c); i < end; i++)                     \
+        perm[offsets[pick_bucket(&r, sh->nbuckets)]++] = (T)(i + 1);        \
+}                                                                           \
+static void shuffle_bucket_##suffix(Shuffle *sh, uint64_t b) {              \
+    T *perm = (T *)sh->perm + sh->bucket_start[b];                          \
+    uint64_t len = sh->bucket_start[b + 1] - sh->bucket_start[b];           \
+    Rng r;                                                                  \
+    rng_stream(&r, sh->seed, GEN_CHUNKS + b);                               \
+    /* Swap each slot with a random one at or before it */                  \
+    for (uint64_t i = len; i > 1; i--) {                                    \
+        uint64_t j = rng_below(&r, i);                                      \
+        T tmp = perm[i - 1];                                                \
+        perm[i - 1] = perm[j];                                              \
+        perm[j] = tmp;                                                      \
+    }                                                                       \
+}                                                                           \
+static size_t format_bucket_##suffix(Shuffle *sh, uint64_t b, char *out) {  \
+    T *perm = sh->perm;                                                     \
+    char *p = out;                                                          \
+    for (uint64_t i = sh->bucket_start[b]; i < sh->bucket_start[b + 1]; i++) { \
+        p = put_ull(p, perm[i]);                                            \
+        *p++ = '\n';                                                        \
+    }                                                                       \
+    return p - out;                                                         \
+}
+
+DEFINE_SHUFFLE_OPS(32, uint32_t)
+DEFINE_SHUFFLE_OPS(64, uint64_t)
+
+static void *task_worker(void *arg) {
+    Shuffle *sh = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&sh->lock);
+        uint64_t t = sh->next_task++;
+        pthread_mutex_unlock(&sh->lock);
+
+        if (t >= sh->ntasks)
+            break;
+        sh->task(sh, t);
+    }
+    return NULL;
+}
+
+// Run tasks 0..ntasks-1 of one phase on nthreads threads and wait for them.
+static void run_phase(Shuffle *sh, task_fn task, uint64_t ntasks, int nthreads) {
+    pthread_t tids[MAX_THREADS];
+
+    sh->task = task;
+    sh->next_task = 0;
+    sh->ntasks = ntasks;
+
+    if (nthreads == 1) {
+        task_worker(sh);
+        return;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, task_worker, sh) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+}
+
+// Format buckets into the slot ring; the main thread writes them in order.
+static void *format_worker(void *arg) {
+    Shuffle *sh = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&sh->lock);
+        uint64_t b = sh->next_task++;
+        pthread_mutex_unlock(&sh->lock);
+
+        if (b >= sh->nbuckets)
+            break;
+
+        // Wait until the writer has drained the slot this bucket maps to
+        Slot *s = &sh->slots[b % sh->nslots];
+        pthread_mutex_lock(&sh->lock);
+        while (s->bucket != b && !sh->failed)
+            pthread_cond_wait(&sh->cond, &sh->lock);
+        pthread_mutex_unlock(&sh->lock);
+        if (sh->failed)
+            break;
+
+        s->len = sh->format_bucket(sh, b, s->buf);
+
+        pthread_mutex_lock(&sh->lock);
+        s->ready = 1;
+        pthread_cond_broadcast(&sh->cond);
+        pthread_mutex_unlock(&sh->lock);
+    }
+    return NULL;
+}
+
+// Write the buckets to fd in order, formatting them on nthreads threads.
+static int write_buckets(Shuffle *sh, int nthreads) {
+    pthread_t tids[MAX_THREADS];
+    uint64_t longest = 0;
+    int rc = 0;
+
+    for (uint64_t b = 0; b < sh->nbuckets; b++)
+        if (sh->bucket_start[b + 1] - sh->bucket_start[b] > longest)
+            longest = sh->bucket_start[b + 1] - sh->bucket_start[b];
+
+    // Two slots per thread lets formatting run ahead of the writer
+    sh->nslots = nthreads == 1 ? 1 : 2 * nthreads;
+    sh->slots = calloc(sh->nslots, sizeof(Slot));
+    if (sh->slots == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+    for (int i = 0; i < sh->nslots; i++) {
+        sh->slots[i].bucket = i;
+        if ((sh->slots[i].buf = malloc(longest * MAX_LINE_LEN + 1)) == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return -1;
+        }
+    }
+
+    if (nthreads == 1) {
+        for (uint64_t b = 0; b < sh->nbuckets && rc == 0; b++) {
+            size_t len = sh->format_bucket(sh, b, sh->slots[0].buf);
+            rc = write_all(sh->fd, sh->slots[0].buf, len);
+        }
+    } else {
+        sh->next_task = 0;
+        for (int i = 0; i < nthreads; i++) {
+            if (pthread_create(&tids[i], NULL, format_worker, sh) != 0) {
+                fprintf(stderr, "Failed to create thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        for (uint64_t b = 0; b < sh->nbuckets && rc == 0; b++) {
+            Slot *s = &sh->slots[b % sh->nslots];
+
+            pthread_mutex_lock(&sh->lock);
+            while (!(s->bucket == b && s->ready))
+                pthread_cond_wait(&sh->cond, &sh->lock);
+            pthread_mutex_unlock(&sh->lock);
+
+            rc = write_all(sh->fd, s->buf, s->len);
+
+            pthread_mutex_lock(&sh->lock);
+            if (rc < 0)
+                sh->failed = 1;
+            s->ready = 0;
+            s->bucket = b + sh->nslots;
+            pthread_cond_broadcast(&sh->cond);
+            pthread_mutex_unlock(&sh->lock);
+        }
+
+        for (int i = 0; i < nthreads; i++)
+            pthread_join(tids[i], NULL);
+    }
+
+    if (rc < 0)
+        perror("write");
+    for (int i = 0; i < sh->nslots; i++)
+        free(sh->slots[i].buf);
+    free(sh->slots);
+    return rc;
+}
+
+// Shuffle 1..n in memory and write it to fd.
+// Each number is sent to a random bucket, then every bucket is shuffled with
+// Fisher-Yates. Given the bucket sizes, every order is equally likely, so the
+// result is a uniform shuffle. Chunks and buckets have their own generators,
+// so the output depends on the seed but not on the number of threads.
+static int shuffle_memory(int fd, uint64_t n, uint64_t seed, int nthreads) {
+    Shuffle sh;
+    int wide = n > UINT32_MAX;
+    int rc;
+
+    memset(&sh, 0, sizeof(sh));
+    sh.n = n;
+    sh.seed = seed;
+    sh.fd = fd;
+
+    // Bucket count depends only on n: a power of two giving about BUCKET_NUMS numbers each
+    sh.nbuckets = 1;
+    while (sh.nbuckets < MAX_BUCKETS && sh.nbuckets * BUCKET_NUMS < n)
+        sh.nbuckets *= 2;
+
+    sh.perm = malloc(n * (wide ? sizeof(uint64_t) : sizeof(uint32_t)));
+    sh.offsets = calloc(GEN_CHUNKS * sh.nbuckets, sizeof(uint64_t));
+    sh.bucket_start = malloc((sh.nbuckets + 1) * sizeof(uint64_t));
+    if (sh.perm == NULL || sh.offsets == NULL || sh.bucket_start == NULL) {
+        fprintf(stderr, "Failed to allocate memory. Try --stream for large N.\n");
+        free(sh.perm);
+        free(sh.offsets);
+        free(sh.bucket_start);
+        return -1;
+    }
+
+    sh.scatter = wide ? scatter_64 : scatter_32;
+    sh.shuffle_bucket = wide ? shuffle_bucket_64 : shuffle_bucket_32;
+    sh.format_bucket = wide ? format_bucket_64 : format_bucket_32;
+    pthread_mutex_init(&sh.lock, NULL);
+    pthread_cond_init(&sh.cond, NULL);
+
+    stats_phase("scatter");
+    run_phase(&sh, scatter_count, GEN_CHUNKS, nthreads);
+
+    // Turn the counts into offsets. Within a bucket, chunks keep their order.
+    uint64_t pos = 0;
+    for (uint64_t b = 0; b < sh.nbuckets; b++) {
+        sh.bucket_start[b] = pos;
+        for (uint64_t c = 0; c < GEN_CHUNKS; c++) {
+            uint64_t count = sh.offsets[c * sh.nbuckets + b];
+            sh.offsets[c * sh.nbuckets + b] = pos;
+            pos += count;
+        }
+    }
+    sh.bucket_start[sh.nbuckets] = pos;
+
+    run_phase(&sh, sh.scatter, GEN_CHUNKS, nthreads);
+    stats_phase("shuffle");
+    run_phase(&sh, sh.shuffle_bucket, sh.nbuckets, nthreads);
+    stats_phase("output");
+    rc = write_buckets(&sh, nthreads);
+
+    pthread_mutex_destroy(&sh.lock);
+    pthread_cond_destroy(&sh.cond);
+    free(sh.perm);
+    free(sh.offsets);
+    free(sh.bucket_start);
+    return rc;
+}
+
+// Write a shuffle of 1..n to fd, computing each position on the fly.
+static int stream_shuffle(int fd, uint64_t n, Rng *rng) {
+    stats_phase("output");
+    char *buf = malloc(OUT_BUF_SIZE + MAX_LINE_LEN);
+    char *p = buf;
+    Feistel f;
+    int rc = 0;
+
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+    feistel_init(&f, n, rng);
+
+    for (uint64_t i = 0; i < n && rc == 0; i++) {
+        p = put_ull(p, feistel_permute(&f, i) + 1);
+        *p++ = '\n';
+        if (p - buf >= OUT_BUF_SIZE) {
+            rc = write_all(fd, buf, p - buf);
+            p = buf;
+        }
+    }
+    if (rc == 0)
+        rc = write_all(fd, buf, p - buf);
+    if (rc < 0)
+        perror("write");
+    free(buf);
+    return rc;
+}
+
+static void usage(void) {
+    fprintf(stderr, "./genrand [--seed S] [-j threads] [--stream] [--stats] [N] [filename]\n");
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    int opt;
+    int opt_stream = 0;
+    int nthreads = 1;
+    char *endptr;
+
+    stats_init(&argc, argv);
+    stats_phase("parse");
+
+    static struct option long_options[] = {
+        { "seed",   required_argument, NULL, 's' },
+        { "stream", no_argument,       NULL, 'S' },
+        { "jobs",   required_argument, NULL, 'j' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "s:Sj:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                errno = 0;
+                seed = strtoull(optarg, &endptr, 0);
+                if (*optarg == '\0' || *endptr != '\0' || errno == ERANGE) {
+                    fprintf(stderr, "%s is not a valid seed.\n", optarg);
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                opt_stream++;
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                if (nthreads < 1 || nthreads > MAX_THREADS) {
+                    fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    int nargs = argc - optind;
+    char **args = argv + optind;
+
+    // Same checks, in the same order, as genrand.sh
+    if (nargs >= 3) {
+        fprintf(stderr, "Too many arguments (more than 3 arguments).\n");
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    if (nargs == 0) {
+        fprintf(stderr, "There are no arguments. There needs to be 2 arguments.\n");
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    if (nargs == 1) {
+        fprintf(stderr, "There was only 1 argument, but 2 arguments are required.\n");
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    if (args[1][0] == '\0') {
+        fprintf(stderr, "You need to provide a filename\n");
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // Check if the first parameter is not a positive integer.
+    errno = 0;
+    uint64_t n = strtoull(args[0], &endptr, 10);
+    if (args[0][0] < '0' || args[0][0] > '9' || *endptr != '\0' || errno == ERANGE) {
+        fprintf(stderr, "%s is not a positive integer.\n", args[0]);
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the file, replacing it if it already exists.
+    int fd = open(args[1], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror(args[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    Rng rng;
+    rng_seed(&rng, seed);
+
+    int rc = 0;
+    if (n > 0 && opt_stream)
+        rc = stream_shuffle(fd, n, &rng);
+    else if (n > 0)
+        rc = shuffle_memory(fd, n, seed, nthreads);
+
+    if (close(fd) < 0) {
+        perror(args[1]);
+        rc = -1;
+    }
+
+    return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -5,8 +5,10 @@
 #  Description    : A C program that prints logtime statistics from the utmp file.
 #  Purpose        : To combine multiple concepts such as string parsing, open/read functions, locales, etc.
 #  Usage          : ./logtimes
-#  Build with     : ./logtimes [options] username
-#  Modifications  :
+#  Build with     : ./logtimes [-a] [-f file] [--stats] username
+#  Modifications  : Output is buffered through fastfmt.h. Days of logged time are now counted from
+#                   the total seconds; they used to come from an uninitialized variable.
+#                   Added --stats, which also counts the records read of each type.
 */
 
 // I used certain implemntations of last.c in this code.
@@ -23,6 +25,8 @@
 #include <locale.h>
 #include <time.h>
 #include <libgen.h>
+#include "stats.h"
+#include "fastfmt.h"
 
 #ifndef SHUTDOWN_TIME
     #define SHUTDOWN_TIME 32 /* Give it a value larger than the other types */
@@ -36,23 +40,49 @@ typedef int BOOL;
 #define BAD_FORMAT_ERROR 2
 
 
+static OutBuf out;  // Everything printed to stdout goes through here
+
+// Records read of each ut_type, for --stats
+static const char *const record_types[] = {
+    "empty", "run_lvl", "boot_time", "new_time", "old_time",
+    "init_process", "login_process", "user_process", "dead_process", "accounting"
+};
+static unsigned long record_counts[11];    // The last one counts types not listed
+
+static void print_record_counts(FILE *fp) {
+    for (int i = 0; i < 10; i++)
+        fprintf(fp, " records_%s=%lu", record_types[i], record_counts[i]);
+    fprintf(fp, " records_other=%lu", record_counts[10]);
+}
+
 void convertTime(time_t seconds) {
-    int days, hours, minutes, secs; // Will hold the number of days, hours, minutes, seconds
+    long days, hours, minutes, secs; // Will hold the number of days, hours, minutes, seconds
 
     minutes  = (seconds / 60) % 60;
     hours    = (seconds / 3600) % 24;
-    days     = secs / 86400;
-    secs = seconds % 60;
-
-    if (days > 0)
-        printf("%d days", days);
-    if (hours > 0)
-        printf(" %d hours", hours);
-    if (minutes > 0)
-        printf(" %d mins", minutes);
-    if (secs > 0)
-        printf(" %d secs", secs);
-    printf("\n");
+    days     = seconds / 86400;
+    secs     = seconds % 60;
+
+    if (days > 0) {
+        out_ll(&out, days);
+        out_str(&out, " days");
+    }
+    if (hours > 0) {
+        out_char(&out, ' ');
+        out_ll(&out, hours);
+        out_str(&out, " hours");
+    }
+    if (minutes > 0) {
+        out_char(&out, ' ');
+        out_ll(&out, minutes);
+        out_str(&out, " mins");
+    }
+    if (secs > 0) {
+        out_char(&out, ' ');
+        out_ll(&out, secs);
+        out_str(&out, " secs");
+    }
+    out_char(&out, '\n');
 }
 
 
@@ -114,7 +144,8 @@ void printList(struct Users *head, char* flag) {
                     temp = temp->next;
                 }
             }
-            printf("%s ", current->str);
+            out_str(&out, current->str);
+            out_char(&out, ' ');
             convertTime(current->num + sum);
             current = current->next;
         }
@@ -141,7 +172,8 @@ void printList(struct Users *head, char* flag) {
             }
 
             if (strcmp(current->str, flag) == 0) {
-                printf("%s ", current->str);
+                out_str(&out, current->str);
+                out_char(&out, ' ');
                 convertTime(current->num + sum);
                 return;
             }
@@ -212,6 +244,7 @@ int get_prev_utrec(int fd, struct utmpx *ut, BOOL *finished )
         return FALSE;
     }
     else { /* Successful read of utmpx record */
+        record_counts[(unsigned)ut->ut_type < 10 ? ut->ut_type : 10]++;
         saved_offset = saved_offset - utsize; /* Reposition saved_offset. */
         if ( saved_offset >= 0 ) {
             /* Seek to preceding record to set up next read. */
@@ -291,8 +324,12 @@ void erase_utlist(utlist **list)
 
 int main( int argc, char* argv[] )
 {
+    stats_init(&argc, argv);
+    stats_extra(print_record_counts);
+
     /* Set the locale. */
     setlocale(LC_TIME, "");
+    out_init(&out, STDOUT_FILENO);
 
     struct Users* users = NULL;
 
@@ -342,6 +379,7 @@ int main( int argc, char* argv[] )
             start_time = utmp_entry.ut_tv.tv_sec ;
 
             /* Process the wtmp file */
+            stats_phase("read");
             while ( !done ) {
                 errno = 0;
                 if ( get_prev_utrec(fd_utmp, &utmp_entry, &done)  ) {
@@ -375,6 +413,7 @@ int main( int argc, char* argv[] )
             }
 
             flag = 0;
+            stats_phase("report");
             printList(users, "");
 
             break;
@@ -403,6 +442,7 @@ int main( int argc, char* argv[] )
         start_time = utmp_entry.ut_tv.tv_sec ;
 
         /* Process the wtmp file */
+        stats_phase("read");
         while ( !done ) {
             errno = 0;
             if ( get_prev_utrec(fd_utmp, &utmp_entry, &done)  ) {
@@ -435,6 +475,7 @@ int main( int argc, char* argv[] )
                     fatal_error(2, " read failed");
         }
 
+        stats_phase("report");
         if (2 == argc){
             printList(users, argv[1]);
         } else {
@@ -446,5 +487,10 @@ int main( int argc, char* argv[] )
 
     erase_utlist(&saved_ut_recs);
     close(fd_utmp);
+    stats_phase("output");
+    if (out_close(&out) < 0) {
+        perror("write");
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file
@@ -5,75 +5,1093 @@
 #  Description    : A C program that prints increasing or decreasing numbers given an incrementor or decrementor.
 #  Purpose        : To similate the seq command and to learn how to write out first code
 #  Usage          : ./myseq
-#  Build with     : ./myseq <num1> [increment] [<num2>]
-#  Modifications  :
+#  Build with     : ./myseq [-j threads] [-o file] [-s sep] [-w | -f format] [--stats] <num1> [increment] [<num2>]
+#  Modifications  : Added -j to format large ranges on several threads. The range is split into blocks whose
+#                   output size is known from the digit counts, so blocks are written in order to stdout,
+#                   or with pwrite() at their final offset when stdout is a regular file.
+#                   Numbers are now 64-bit, may have a fractional part, and may be arbitrarily large.
+#                   Added -s (separator), -w (equal width) and -f (printf format). Common formats are
+#                   compiled once into the block formatters instead of calling printf per number.
+#                   Added -o to write straight into a file preallocated to the exact output size.
+#                   Digits and buffered output come from fastfmt.h, and the formats only printf can
+#                   handle are formatted into that buffer instead of going through stdio.
+#                   Added --stats.
 */
 
+// Note: To compile, use -pthread
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "stats.h"
+#include "fastfmt.h"
 
-int main(int argc, char *argv[]) {
+#define BLOCK_NUMS   65536     // Numbers formatted per block
+#define BLOCK_BYTES  (1 << 21) // Blocks of long numbers hold fewer of them
+#define MAX_THREADS  256
+#define MAX_DIGITS   1024      // Longest number accepted on the command line
 
+// How the sequence is represented. Each kind has its own formatting loop.
+enum { SEQ_INT, SEQ_FIXED, SEQ_BIG };
 
-    // If there are between one and three arguments or less,
-    if (argc > 1 && argc <= 4) {
-        // Check if any argument is not an integer.
-        for (int i=1; i<argc; i++) {
-            char *endptr;
-            long long val = strtoll(argv[i], &endptr, 10);
-            if (*endptr != '\0' || errno == ERANGE) {
-                fprintf(stderr, "USAGE: %s <num1> [increment] [<num2>]\n", argv[0]);
-                return -1;
-            }
+typedef struct Seq Seq;
+typedef size_t (*format_fn)(char *out, long long v, long long n, const Seq *seq);
+
+// A sequence that fits in 64 bits. SEQ_FIXED values are scaled by 10^frac.
+struct Seq {
+    int kind;
+    int frac;               // Digits after the decimal point
+    long long scale;        // 10^frac
+    long long first, step, count;
+    format_fn format_block;
+    long long block_nums;   // Numbers per block
+    size_t max_len;         // Longest printed number, with its decoration and separator
+
+    // Decoration from -s, -w and -f, worked out once before printing
+    const char *sep;
+    size_t seplen;
+    const char *prefix, *suffix;  // Text around the number, with %% already unescaped
+    size_t prefix_len, suffix_len;
+    int out_frac;           // Digits printed after the point, at least frac
+    int width;              // Minimum width of the number
+    char pad;               // '0' or ' '
+    int left;               // Pad on the right instead
+    char sign;              // Printed before non-negative numbers: '+', ' ' or 0
+    char *printf_fmt;       // Set when the format has to go through printf
+};
+
+// A parsed -f format with one floating-point directive
+typedef struct {
+    char *prefix, *suffix;
+    char flags[8];
+    int width;
+    int prec;               // -1 when not given
+    char conv;
+    char *long_fmt;         // The format with an L added for long double
+} Format;
+
+// Arbitrary-precision decimal, digits stored least significant first
+typedef struct {
+    int neg;
+    int len;                // Zero has length 0
+    char d[2 * MAX_DIGITS + 2];   // Room to scale a number by up to MAX_DIGITS decimals
+} Big;
+
+static inline char *put_int(char *p, long long v, const Seq *seq) {
+    (void)seq;
+    return put_ll(p, v);
+}
+
+// Write u / 10^frac with exactly frac digits after the decimal point.
+static inline char *put_ufixed(char *p, unsigned long long u, const Seq *seq) {
+    unsigned long long fpart = u % seq->scale;
+
+    p = put_ull(p, u / seq->scale);
+    *p++ = '.';
+
+    // Fill the fraction from the right so leading zeros are kept
+    for (int i = seq->frac - 1; i >= 0; i--) {
+        p[i] = (char)('0' + fpart % 10);
+        fpart /= 10;
+    }
+    return p + seq->frac;
+}
+
+static inline char *put_fixed(char *p, long long v, const Seq *seq) {
+    if (v < 0) {
+        *p++ = '-';
+        return put_ufixed(p, -(unsigned long long)v, seq);
+    }
+    return put_ufixed(p, (unsigned long long)v, seq);
+}
+
+// Write v zero padded to seq->width, for -w on whole numbers. No number in the
+// range is wider than num1 or num2, so the digits always fit.
+static inline char *put_padded(char *p, long long v, const Seq *seq) {
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    char *end = p + seq->width;
+    char *t = end;
+
+    while (u >= 100) {
+        unsigned r = u % 100;
+        u /= 100;
+        t -= 2;
+        memcpy(t, digit_pairs + 2 * r, 2);
+    }
+    if (u >= 10) {
+        t -= 2;
+        memcpy(t, digit_pairs + 2 * u, 2);
+    } else {
+        *--t = (char)('0' + u);
+    }
+
+    if (v < 0)
+        *p++ = '-';
+    memset(p, '0', t - p);
+    return end;
+}
+
+// Write v with the padding, sign and text around it that -w or -f asked for.
+static inline char *put_fmt(char *p, long long v, const Seq *seq) {
+    char body[64];
+    char *b = body;
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+
+    if (v < 0)
+        *b++ = '-';
+    else if (seq->sign)
+        *b++ = seq->sign;
+    size_t signlen = b - body;
+
+    if (seq->frac > 0) {
+        b = put_ufixed(b, u, seq);
+    } else {
+        b = put_ull(b, u);
+        if (seq->out_frac > 0)
+            *b++ = '.';
+    }
+    // A format may ask for more decimals than the numbers have
+    memset(b, '0', seq->out_frac - seq->frac);
+    b += seq->out_frac - seq->frac;
+    size_t len = b - body;
+
+    memcpy(p, seq->prefix, seq->prefix_len);
+    p += seq->prefix_len;
+
+    if (len < (size_t)seq->width) {
+        size_t fill = seq->width - len;
+        if (seq->left) {
+            memcpy(p, body, len);
+            memset(p + len, ' ', fill);
+        } else if (seq->pad == '0') {
+            // Zeros go between the sign and the digits
+            memcpy(p, body, signlen);
+            memset(p + signlen, '0', fill);
+            memcpy(p + signlen + fill, body + signlen, len - signlen);
+        } else {
+            memset(p, ' ', fill);
+            memcpy(p + fill, body, len);
         }
+        p += len + fill;
+    } else {
+        memcpy(p, body, len);
+        p += len;
+    }
 
-        // If only one number given,
-        if(argc == 2){
-            // and if the first argument is less than 1,
-            if(atoi(argv[1]) < 1){
-                // then do nothing.
-            } else {
-                // else print from 1 to num1 in increments of 1.
-                for (int i=1; i<=atoi(argv[1]); i++){
-                    printf("%d\n", i);
-                }
+    memcpy(p, seq->suffix, seq->suffix_len);
+    return p + seq->suffix_len;
+}
+
+// Stamp out one block formatter per kind and separator length so the inner
+// loop has no per-number branches. Every number is followed by the separator;
+// the caller turns the very last one into a newline.
+#define DEFINE_FORMAT_BLOCK(name, PUT, SEP_IS_CHAR)                             \
+static size_t name(char *out, long long v, long long n, const Seq *seq) {      \
+    char *p = out;                                                              \
+    for (long long k = 0; k < n; k++) {                                         \
+        p = PUT(p, v, seq);                                                     \
+        if (SEP_IS_CHAR) {                                                      \
+            *p++ = seq->sep[0];                                                 \
+        } else {                                                                \
+            memcpy(p, seq->sep, seq->seplen);                                   \
+            p += seq->seplen;                                                   \
+        }                                                                       \
+        /* Unsigned add so stepping past the last number cannot overflow */    \
+        v = (long long)((unsigned long long)v + (unsigned long long)seq->step); \
+    }                                                                           \
+    return p - out;                                                             \
+}
+
+DEFINE_FORMAT_BLOCK(format_block_int, put_int, 1)
+DEFINE_FORMAT_BLOCK(format_block_fixed, put_fixed, 1)
+DEFINE_FORMAT_BLOCK(format_block_padded, put_padded, 1)
+DEFINE_FORMAT_BLOCK(format_block_fmt, put_fmt, 1)
+DEFINE_FORMAT_BLOCK(format_block_int_sep, put_int, 0)
+DEFINE_FORMAT_BLOCK(format_block_fixed_sep, put_fixed, 0)
+DEFINE_FORMAT_BLOCK(format_block_padded_sep, put_padded, 0)
+DEFINE_FORMAT_BLOCK(format_block_fmt_sep, put_fmt, 0)
+
+// Formatters indexed by [style][multi-byte separator]
+enum { STYLE_INT, STYLE_FIXED, STYLE_PADDED, STYLE_FMT };
+static const format_fn formatters[4][2] = {
+    { format_block_int,    format_block_int_sep },
+    { format_block_fixed,  format_block_fixed_sep },
+    { format_block_padded, format_block_padded_sep },
+    { format_block_fmt,    format_block_fmt_sep },
+};
+
+// Floor and ceiling division for 128-bit values with a positive divisor
+static __int128 floor_div(__int128 a, __int128 b) {
+    __int128 q = a / b;
+    if ((a % b != 0) && (a < 0))
+        q--;
+    return q;
+}
+
+static __int128 ceil_div(__int128 a, __int128 b) {
+    __int128 q = a / b;
+    if ((a % b != 0) && (a > 0))
+        q++;
+    return q;
+}
+
+// Count the k in [0, count) for which first + k*step lies in [lo, hi].
+static long long terms_in(__int128 first, __int128 step, long long count, __int128 lo, __int128 hi) {
+    // A decreasing sequence is an increasing one over the negated values
+    if (step < 0) {
+        __int128 tmp = lo;
+        lo = -hi;
+        hi = -tmp;
+        first = -first;
+        step = -step;
+    }
+
+    __int128 kmin = ceil_div(lo - first, step);
+    __int128 kmax = floor_div(hi - first, step);
+
+    if (kmin < 0)
+        kmin = 0;
+    if (kmax > count - 1)
+        kmax = count - 1;
+
+    return kmax < kmin ? 0 : (long long)(kmax - kmin + 1);
+}
+
+// Printed length of a number with d digits (of its scaled value), including the separator.
+static size_t num_len(const Seq *seq, int d, int neg) {
+    // Digits before the point, at least one, then the point and the decimals
+    size_t len = (d > seq->frac + 1 ? d - seq->frac : 1) + (seq->out_frac > 0 ? seq->out_frac + 1 : 0);
+
+    len += neg || seq->sign;
+    if (len < (size_t)seq->width)
+        len = seq->width;
+    return len + seq->prefix_len + seq->suffix_len + seq->seplen;
+}
+
+// Exact number of bytes printed for the first count numbers of seq, each
+// followed by the separator. Every number with the same digit count has the
+// same length, so this only counts how many fall in each power-of-ten band.
+static off_t seq_bytes(const Seq *seq, long long count) {
+    __int128 lo = 0, hi = 9;
+    off_t total = 0;
+
+    for (int d = 1; d <= 19; d++) {
+        total += (off_t)terms_in(seq->first, seq->step, count, lo, hi) * num_len(seq, d, 0);
+        total += (off_t)terms_in(seq->first, seq->step, count, -hi, (lo == 0 ? -1 : -lo)) * num_len(seq, d, 1);
+        lo = hi + 1;
+        hi = hi * 10 + 9;
+    }
+    return total;
+}
+
+// Format numbers k to k+n-1, starting at value v. The sequence ends with a newline, not the separator.
+static size_t format_range(char *out, long long v, long long k, long long n, const Seq *seq) {
+    size_t len = seq->format_block(out, v, n, seq);
+
+    if (k + n == seq->count) {
+        len -= seq->seplen;
+        out[len++] = '\n';
+    }
+    return len;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+
+// One output buffer. In ordered mode slot b % nslots holds block b.
+typedef struct {
+    char *buf;
+    size_t len;
+    long long block;    // Block this slot is waiting for or holds
+    int ready;          // Block has been formatted and not yet written
+} Slot;
+
+// State shared by all workers of one -j run
+typedef struct {
+    const Seq *seq;
+    long long nblocks;
+    int fd;
+    int use_pwrite;     // Workers write their own blocks at precomputed offsets
+    char *map;          // Or format straight into the mapped output file
+    off_t base;         // Offset of the first byte when using pwrite
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    long long next_block;   // Next block a worker will claim
+    int nslots;
+    Slot *slots;
+    int failed;             // Set and read only through job_failed() and job_fail()
+} Job;
+
+// Workers check failed outside the lock, so it is read and written atomically
+static inline int job_failed(Job *job) {
+    return __atomic_load_n(&job->failed, __ATOMIC_ACQUIRE);
+}
+
+static inline void job_fail(Job *job) {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+    Job *job;
+    int id;
+} Worker;
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    Job *job = w->job;
+    const Seq *seq = job->seq;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        long long b = job->next_block++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (b >= job->nblocks || job_failed(job))
+            break;
+
+        long long k = b * seq->block_nums;
+        long long n = seq->count - k < seq->block_nums ? seq->count - k : seq->block_nums;
+        long long v = (long long)(seq->first + (__int128)k * seq->step);
+
+        // The last block ends with a newline instead of the separator, so it
+        // is formatted in a slot rather than possibly running past the map.
+        if (job->map != NULL && k + n < seq->count) {
+            seq->format_block(job->map + seq_bytes(seq, k), v, n, seq);
+            continue;
+        }
+
+        if (job->use_pwrite || job->map != NULL) {
+            // Each worker owns a slot and writes its blocks directly in place
+            Slot *s = &job->slots[w->id];
+            off_t off = job->base + seq_bytes(seq, k);
+
+            s->len = format_range(s->buf, v, k, n, seq);
+            if (job->map != NULL) {
+                memcpy(job->map + off, s->buf, s->len);
+            } else if (pwrite_all(job->fd, s->buf, s->len, off) < 0) {
+                perror("pwrite");
+                job_fail(job);
             }
+            continue;
         }
 
-        // If there is only 2 numbers (num1 and num2)
-        if(argc == 3){
-            // and if num2 is less than num1,
-            if(atoi(argv[2]) < atoi(argv[1])){
-                // then do nothing.
-            } else {
-                // else print from num1 to num2 in increments of 1.
-                for (int i=atoi(argv[1]); i<=atoi(argv[2]); i++){
-                    printf("%d\n", i);
-                }
+        // Wait until the writer has drained the slot this block maps to
+        Slot *s = &job->slots[b % job->nslots];
+        pthread_mutex_lock(&job->lock);
+        while (s->block != b && !job_failed(job))
+            pthread_cond_wait(&job->cond, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+        if (job_failed(job))
+            break;
+
+        s->len = format_range(s->buf, v, k, n, seq);
+
+        pthread_mutex_lock(&job->lock);
+        s->ready = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+// Print the sequence to fd using nthreads workers. If map is given, the
+// workers fill it instead of writing to fd. Returns 0 on success.
+static int run_parallel(const Seq *seq, int nthreads, int fd, char *map) {
+    stats_phase("output");
+    Job job;
+    struct stat st;
+    pthread_t tids[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+
+    memset(&job, 0, sizeof(job));
+    job.seq = seq;
+    job.nblocks = (seq->count + seq->block_nums - 1) / seq->block_nums;
+    job.fd = fd;
+    job.map = map;
+
+    // pwrite() ignores the offset on O_APPEND files, so those are written in order
+    if (map == NULL && fstat(job.fd, &st) == 0 && S_ISREG(st.st_mode) && !(fcntl(job.fd, F_GETFL) & O_APPEND)) {
+        job.base = lseek(job.fd, 0, SEEK_CUR);
+        job.use_pwrite = (job.base >= 0);
+    }
+
+    // Two slots per worker lets formatting run ahead of the writer
+    job.nslots = (job.use_pwrite || map != NULL) ? nthreads : 2 * nthreads;
+    job.slots = calloc(job.nslots, sizeof(Slot));
+    if (job.slots == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+    for (int i = 0; i < job.nslots; i++) {
+        job.slots[i].block = i;
+        if ((job.slots[i].buf = malloc(seq->block_nums * seq->max_len)) == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return -1;
+        }
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].job = &job;
+        workers[i].id = i;
+        if (pthread_create(&tids[i], NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // This thread is the writer when the output has to be streamed in order
+    if (!job.use_pwrite && map == NULL) {
+        for (long long b = 0; b < job.nblocks && !job_failed(&job); b++) {
+            Slot *s = &job.slots[b % job.nslots];
+
+            pthread_mutex_lock(&job.lock);
+            while (!(s->block == b && s->ready))
+                pthread_cond_wait(&job.cond, &job.lock);
+            pthread_mutex_unlock(&job.lock);
+
+            int rc = write_all(job.fd, s->buf, s->len);
+
+            pthread_mutex_lock(&job.lock);
+            if (rc < 0) {
+                perror("write");
+                job_fail(&job);
             }
+            s->ready = 0;
+            s->block = b + job.nslots;
+            pthread_cond_broadcast(&job.cond);
+            pthread_mutex_unlock(&job.lock);
         }
+    }
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    // Leave the file offset after the output, as if it had been written normally
+    if (job.use_pwrite && !job_failed(&job))
+        lseek(job.fd, job.base + seq_bytes(seq, seq->count) - seq->seplen + 1, SEEK_SET);
+
+    for (int i = 0; i < job.nslots; i++)
+        free(job.slots[i].buf);
+    free(job.slots);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+
+    return job_failed(&job) ? -1 : 0;
+}
 
-        // If there are three numbers,
-        if(argc == 4){
-            // and if the increment is 0, print error.
-            if(atoi(argv[2]) == 0){
-                fprintf(stderr, "Increment must be a non-zero number\n");
+// Print the sequence on this thread, one block at a time.
+static int run_serial(const Seq *seq) {
+    stats_phase("output");
+    char *buf = malloc(seq->block_nums * seq->max_len);
+    long long v = seq->first;
+
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+
+    for (long long k = 0; k < seq->count; k += seq->block_nums) {
+        long long n = seq->count - k < seq->block_nums ? seq->count - k : seq->block_nums;
+        size_t len = format_range(buf, v, k, n, seq);
+
+        if (write_all(STDOUT_FILENO, buf, len) < 0) {
+            perror("write");
+            free(buf);
+            return -1;
+        }
+        v = (long long)(seq->first + (__int128)(k + n) * seq->step);
+    }
+
+    free(buf);
+    return 0;
+}
+
+// Print the sequence into fd, opened from path. The exact size is known, so a regular file
+// is preallocated once and the workers fill a shared mapping of it. Anything that cannot be
+// sized is printed to as stdout would be.
+static int run_to_file(const Seq *seq, int nthreads, int fd, const char *path) {
+    stats_phase("output");
+    off_t total = seq_bytes(seq, seq->count) - seq->seplen + 1;
+    char *map = NULL;
+    struct stat st;
+    int rc;
+
+    // Reserve the blocks up front. Not every file system can, so fall back to setting the size.
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        (fallocate(fd, 0, 0, total) < 0 && ftruncate(fd, total) < 0)) {
+        if (fd != STDOUT_FILENO) {
+            int moved = dup2(fd, STDOUT_FILENO);
+            close(fd);
+            if (moved < 0) {
+                perror(path);
                 return -1;
             }
-            // and if the increment is positive,
-            if(atoi(argv[2]) > 0){
-                // then print from num1 to num2 increasing by the increment for each iteration.
-                for (int i=atoi(argv[1]); i<=atoi(argv[3]); i+=atoi(argv[2])){
-                    printf("%d\n", i);
+        }
+        if (nthreads > 1 && seq->count > seq->block_nums)
+            return run_parallel(seq, nthreads, STDOUT_FILENO, NULL);
+        return run_serial(seq);
+    }
+
+    map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        map = NULL;     // Large pwrite() calls at the precomputed offsets instead
+
+    rc = run_parallel(seq, nthreads, fd, map);
+
+    if (map != NULL && munmap(map, total) < 0) {
+        perror("munmap");
+        rc = -1;
+    }
+    if (close(fd) < 0) {
+        perror(path);
+        rc = -1;
+    }
+    return rc;
+}
+
+// Parse [+-]digits[.digits] into b. Returns 0 if s is not a number.
+static int parse_big(const char *s, Big *b, int *frac) {
+    const char *p = s, *digits;
+    int seen = 0;
+
+    b->neg = 0;
+    if (*p == '+' || *p == '-')
+        b->neg = (*p++ == '-');
+
+    // Skip leading zeros; they do not change the value
+    while (*p == '0') {
+        p++;
+        seen = 1;
+    }
+    digits = p;
+    while (*p >= '0' && *p <= '9')
+        p++;
+    int ilen = p - digits;
+    seen |= ilen > 0;
+
+    *frac = 0;
+    const char *fdigits = NULL;
+    if (*p == '.') {
+        fdigits = ++p;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        *frac = p - fdigits;
+        seen |= *frac > 0;
+    }
+
+    if (!seen || *p != '\0' || ilen + *frac > MAX_DIGITS)
+        return 0;
+
+    // Fraction digits are the low digits of the scaled value
+    b->len = 0;
+    for (int i = *frac - 1; i >= 0; i--)
+        b->d[b->len++] = fdigits[i] - '0';
+    for (int i = ilen - 1; i >= 0; i--)
+        b->d[b->len++] = digits[i] - '0';
+
+    while (b->len > 0 && b->d[b->len - 1] == 0)
+        b->len--;
+    if (b->len == 0)
+        b->neg = 0;
+    return 1;
+}
+
+// Multiply b by 10^k.
+static void big_shift_up(Big *b, int k) {
+    if (b->len == 0 || k == 0)
+        return;
+    memmove(b->d + k, b->d, b->len);
+    memset(b->d, 0, k);
+    b->len += k;
+}
+
+// Compare magnitudes of a and b.
+static int mag_cmp(const Big *a, const Big *b) {
+    if (a->len != b->len)
+        return a->len < b->len ? -1 : 1;
+    for (int i = a->len - 1; i >= 0; i--)
+        if (a->d[i] != b->d[i])
+            return a->d[i] < b->d[i] ? -1 : 1;
+    return 0;
+}
+
+static int big_cmp(const Big *a, const Big *b) {
+    if (a->neg != b->neg)
+        return a->neg ? -1 : 1;
+    return a->neg ? -mag_cmp(a, b) : mag_cmp(a, b);
+}
+
+// |a| += |b|
+static void mag_add(Big *a, const Big *b) {
+    int carry = 0, i;
+
+    for (i = 0; i < b->len || carry; i++) {
+        int sum = (i < a->len ? a->d[i] : 0) + (i < b->len ? b->d[i] : 0) + carry;
+        carry = sum >= 10;
+        a->d[i] = (char)(carry ? sum - 10 : sum);
+    }
+    if (i > a->len)
+        a->len = i;
+}
+
+// |a| = |x| - |y|, where |x| >= |y|. a may be the same as x.
+static void mag_sub(Big *a, const Big *x, const Big *y) {
+    int borrow = 0;
+
+    for (int i = 0; i < x->len; i++) {
+        int diff = x->d[i] - (i < y->len ? y->d[i] : 0) - borrow;
+        borrow = diff < 0;
+        a->d[i] = (char)(borrow ? diff + 10 : diff);
+    }
+    a->len = x->len;
+    while (a->len > 0 && a->d[a->len - 1] == 0)
+        a->len--;
+}
+
+// a += b
+static void big_add(Big *a, const Big *b) {
+    if (a->neg == b->neg) {
+        mag_add(a, b);
+    } else if (mag_cmp(a, b) >= 0) {
+        mag_sub(a, a, b);
+    } else {
+        Big tmp;
+        mag_sub(&tmp, b, a);
+        memcpy(a->d, tmp.d, tmp.len);
+        a->len = tmp.len;
+        a->neg = b->neg;
+    }
+    if (a->len == 0)
+        a->neg = 0;
+}
+
+// Convert b to a long long. Returns 0 if it does not fit.
+static int big_to_ll(const Big *b, long long *out) {
+    unsigned __int128 u = 0;
+
+    if (b->len > 20)
+        return 0;
+    for (int i = b->len - 1; i >= 0; i--)
+        u = u * 10 + b->d[i];
+    if (u > (unsigned __int128)LLONG_MAX + b->neg)
+        return 0;
+    *out = b->neg ? (long long)(-(unsigned long long)u) : (long long)u;
+    return 1;
+}
+
+// Write b with frac digits after the decimal point.
+static char *put_big(char *p, const Big *b, int frac) {
+    int n = b->len > frac ? b->len : frac + 1;
+
+    if (b->neg)
+        *p++ = '-';
+    for (int i = n - 1; i >= 0; i--) {
+        *p++ = (char)('0' + (i < b->len ? b->d[i] : 0));
+        if (i == frac && frac > 0)
+            *p++ = '.';
+    }
+    return p;
+}
+
+// Print a sequence too large for 64 bits, one digit string at a time.
+static int run_big(Big *v, const Big *step, const Big *last, const Seq *seq) {
+    stats_phase("output");
+    size_t maxlen = 2 * MAX_DIGITS + seq->width + 4;
+    int dir = step->neg ? -1 : 1;
+    int printed = 0;
+    OutBuf out;
+
+    out_init(&out, STDOUT_FILENO);
+    while (big_cmp(v, last) * dir <= 0 && v->len <= 2 * MAX_DIGITS && !out.err) {
+        // The separator goes between numbers
+        if (printed++)
+            out_mem(&out, seq->sep, seq->seplen);
+
+        if (seq->printf_fmt != NULL) {
+            // Only -f formats that work on long doubles get here
+            char tmp[2 * MAX_DIGITS + 4];
+            *put_big(tmp, v, seq->frac) = '\0';
+            out_printf(&out, seq->printf_fmt, strtold(tmp, NULL));
+        } else {
+            char *start = out_reserve(&out, maxlen);
+            char *p = put_big(start, v, seq->frac);
+
+            // -w pads with zeros after the sign
+            size_t len = p - start;
+            if (len < (size_t)seq->width) {
+                size_t fill = seq->width - len, signlen = v->neg;
+                memmove(start + signlen + fill, start + signlen, len - signlen);
+                memset(start + signlen, '0', fill);
+                p += fill;
+            }
+            out.used = p - out.buf;
+        }
+        big_add(v, step);
+    }
+
+    if (printed)
+        out_char(&out, '\n');
+    int rc = out_close(&out);
+    if (rc < 0)
+        perror("write");
+    return rc;
+}
+
+// Print the sequence through vsnprintf, for formats that were not compiled.
+static int run_printf(const Seq *seq) {
+    stats_phase("output");
+    long long v = seq->first;
+    OutBuf out;
+
+    out_init(&out, STDOUT_FILENO);
+    for (long long k = 0; k < seq->count && !out.err; k++) {
+        out_printf(&out, seq->printf_fmt, (long double)v / seq->scale);
+        out_str(&out, k + 1 < seq->count ? seq->sep : "\n");
+        v = (long long)((unsigned long long)v + (unsigned long long)seq->step);
+    }
+
+    if (out_close(&out) < 0) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+// Copy text into out, turning %% into %. Stops at a lone % and returns where it is.
+static const char *copy_text(const char *s, char *out) {
+    while (*s != '\0') {
+        if (s[0] == '%') {
+            if (s[1] != '%')
+                break;
+            s++;
+        }
+        *out++ = *s++;
+    }
+    *out = '\0';
+    return s;
+}
+
+// Split a -f format around its one floating-point directive. Returns 0 if it is invalid.
+static int parse_format(const char *fmt, Format *f) {
+    size_t n = strlen(fmt);
+    const char *p;
+    int nflags = 0;
+
+    f->prefix = malloc(n + 1);
+    f->suffix = malloc(n + 1);
+    f->long_fmt = malloc(n + 2);
+    if (f->prefix == NULL || f->suffix == NULL || f->long_fmt == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    p = copy_text(fmt, f->prefix);
+    if (*p != '%') {
+        fprintf(stderr, "Format %s has no %% directive\n", fmt);
+        return 0;
+    }
+    p++;
+
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL && nflags < (int)sizeof(f->flags) - 1)
+        f->flags[nflags++] = *p++;
+    f->flags[nflags] = '\0';
+
+    f->width = 0;
+    while (*p >= '0' && *p <= '9')
+        f->width = f->width * 10 + (*p++ - '0');
+
+    f->prec = -1;
+    if (*p == '.') {
+        f->prec = 0;
+        p++;
+        while (*p >= '0' && *p <= '9')
+            f->prec = f->prec * 10 + (*p++ - '0');
+    }
+
+    if (*p == '\0' || strchr("eEfFgGaA", *p) == NULL) {
+        fprintf(stderr, "Format %s has an invalid directive\n", fmt);
+        return 0;
+    }
+    f->conv = *p++;
+
+    if (*copy_text(p, f->suffix) != '\0') {
+        fprintf(stderr, "Format %s has too many %% directives\n", fmt);
+        return 0;
+    }
+
+    // printf needs an L to take a long double
+    size_t at = p - 1 - fmt;
+    memcpy(f->long_fmt, fmt, at);
+    f->long_fmt[at] = 'L';
+    strcpy(f->long_fmt + at + 1, fmt + at);
+    return 1;
+}
+
+// Set up seq to print the -f format with put_fmt. Returns 0 if only printf can print it exactly.
+static int compile_format(const Format *f, Seq *seq, long long lastv) {
+    int prec = f->prec < 0 ? 6 : f->prec;
+
+    if (strchr(f->flags, '#') != NULL || strchr(f->flags, '\'') != NULL || f->width > 4096)
+        return 0;
+
+    if (f->conv == 'f' || f->conv == 'F') {
+        // Fixed decimals print exactly unless they would have to round
+        if (prec < seq->frac || prec > 18)
+            return 0;
+        seq->out_frac = prec;
+    } else if (f->conv == 'g' || f->conv == 'G') {
+        // %g prints whole numbers as they are while they have fewer than prec digits
+        unsigned long long limit = 1;
+        for (int i = 0; i < (prec == 0 ? 1 : prec) && i < 19; i++)
+            limit *= 10;
+        unsigned long long a = seq->first < 0 ? -(unsigned long long)seq->first : (unsigned long long)seq->first;
+        unsigned long long b = lastv < 0 ? -(unsigned long long)lastv : (unsigned long long)lastv;
+        if (seq->frac > 0 || (prec < 19 && (a >= limit || b >= limit)))
+            return 0;
+        seq->out_frac = 0;
+    } else {
+        return 0;
+    }
+
+    seq->prefix = f->prefix;
+    seq->suffix = f->suffix;
+    seq->prefix_len = strlen(f->prefix);
+    seq->suffix_len = strlen(f->suffix);
+    seq->width = f->width;
+    seq->left = strchr(f->flags, '-') != NULL;
+    seq->pad = strchr(f->flags, '0') != NULL ? '0' : ' ';
+    seq->sign = strchr(f->flags, '+') != NULL ? '+' : strchr(f->flags, ' ') != NULL ? ' ' : 0;
+    return 1;
+}
+
+// Check whether s is a number, which may be negative or have a fraction.
+static int is_number(const char *s) {
+    Big b;
+    int frac;
+    return parse_big(s, &b, &frac);
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr, "USAGE: %s [-j threads] [-o file] [-s sep] [-w | -f format] [--stats] <num1> [increment] [<num2>]\n", cmd);
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = 1;
+    int opt;
+    int opt_w = 0;
+    const char *sep = "\n";
+    const char *fmt = NULL;
+    const char *out_path = NULL;
+    Format format;
+
+    stats_init(&argc, argv);
+    stats_phase("parse");
+
+    // Options come first. Stop at the first number so negative numbers are not read as options.
+    while (optind < argc && !is_number(argv[optind]) && (opt = getopt(argc, argv, "+j:o:s:wf:")) != -1) {
+        switch (opt) {
+            case 'j':
+                nthreads = atoi(optarg);
+                if (nthreads < 1 || nthreads > MAX_THREADS) {
+                    fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+                    return -1;
                 }
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            case 's':
+                sep = optarg;
+                break;
+            case 'w':
+                opt_w++;
+                break;
+            case 'f':
+                fmt = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (opt_w && fmt != NULL) {
+        fprintf(stderr, "A format cannot be given when printing equal width numbers\n");
+        return -1;
+    }
+    if (fmt != NULL && !parse_format(fmt, &format))
+        return -1;
+
+    // Paths that cannot size their output up front simply print into the file. Only a regular
+    // file is emptied; a pipe or device such as /dev/stdout is written to as it is. It is opened
+    // for reading too when allowed, since a shared mapping of it needs that.
+    int out_fd = -1;
+    if (out_path != NULL) {
+        struct stat st;
+        out_fd = open(out_path, O_RDWR | O_CREAT, 0666);
+        if (out_fd < 0)
+            out_fd = open(out_path, O_WRONLY | O_CREAT, 0666);
+        if (out_fd < 0 || fstat(out_fd, &st) < 0 || (S_ISREG(st.st_mode) && ftruncate(out_fd, 0) < 0)) {
+            perror(out_path);
+            return -1;
+        }
+    }
+
+    int nargs = argc - optind;
+    char **args = argv + optind;
+
+    // If there are between one and three arguments or less,
+    if (nargs >= 1 && nargs <= 3) {
+        static Big first, step, last;
+        int ffrac = 0, sfrac = 0, lfrac;
+
+        // One number counts up from 1, two count by 1, three give the increment.
+        const char *sfirst = nargs > 1 ? args[0] : "1";
+        const char *sstep = nargs == 3 ? args[1] : "1";
+        const char *slast = args[nargs - 1];
+
+        // Check if any argument is not a number.
+        if (!parse_big(sfirst, &first, &ffrac) || !parse_big(sstep, &step, &sfrac) ||
+            !parse_big(slast, &last, &lfrac)) {
+            usage(argv[0]);
+            return -1;
+        }
+
+        // and if the increment is 0, print error.
+        if (step.len == 0) {
+            fprintf(stderr, "Increment must be a non-zero number\n");
+            return -1;
+        }
+
+        // Like seq, print as many decimals as num1 and the increment have.
+        // Work on integers scaled by 10^frac from here on.
+        int frac = ffrac > sfrac ? ffrac : sfrac;
+        big_shift_up(&first, frac - ffrac);
+        big_shift_up(&step, frac - sfrac);
+        if (lfrac <= frac) {
+            big_shift_up(&last, frac - lfrac);
+        } else {
+            // Drop the extra decimals of num2, rounding towards num1 so it stays a bound
+            int cut = lfrac - frac, rest = 0;
+            for (int i = 0; i < cut && i < last.len; i++)
+                rest |= last.d[i];
+            if (last.len > cut) {
+                memmove(last.d, last.d + cut, last.len - cut);
+                last.len -= cut;
             } else {
-                // else print from num1 to num2 decreasing by the increment for each increment.
-                for (int i=atoi(argv[1]); i>=atoi(argv[3]); i+=atoi(argv[2])){
-                    printf("%d\n", i);
-                }
+                last.len = 0;
             }
+            if (rest && last.neg != step.neg) {
+                Big one = { 0, 1, { 1 } };
+                mag_add(&last, &one);
+            }
+            if (last.len == 0)
+                last.neg = 0;
         }
+
+        Seq seq = { 0 };
+        long long lastv;
+
+        seq.frac = frac;
+        seq.out_frac = frac;
+        seq.sep = sep;
+        seq.seplen = strlen(sep);
+        seq.prefix = seq.suffix = "";
+        seq.pad = '0';
+
+        if (!big_to_ll(&first, &seq.first) || !big_to_ll(&step, &seq.step) ||
+            !big_to_ll(&last, &lastv) || frac > 18) {
+            if (opt_w) {
+                // Equal width is the width of the wider of num1 and num2
+                char tmp[2 * MAX_DIGITS + 4];
+                int w1 = put_big(tmp, &first, frac) - tmp;
+                int w2 = put_big(tmp, &last, frac) - tmp;
+                seq.width = w1 > w2 ? w1 : w2;
+            }
+            seq.printf_fmt = fmt != NULL ? format.long_fmt : NULL;
+            if (out_fd >= 0)
+                dup2(out_fd, STDOUT_FILENO);
+            return run_big(&first, &step, &last, &seq) < 0 ? -1 : 0;
+        }
+
+        seq.kind = frac > 0 ? SEQ_FIXED : SEQ_INT;
+        seq.scale = 1;
+        for (int i = 0; i < frac; i++)
+            seq.scale *= 10;
+
+        // How many numbers lie between first and last. An empty range prints nothing.
+        __int128 count = 0;
+        if ((seq.step > 0 && lastv >= seq.first) || (seq.step < 0 && lastv <= seq.first))
+            count = ((__int128)lastv - seq.first) / seq.step + 1;
+        if (count > LLONG_MAX) {
+            seq.printf_fmt = fmt != NULL ? format.long_fmt : NULL;
+            if (out_fd >= 0)
+                dup2(out_fd, STDOUT_FILENO);
+            return run_big(&first, &step, &last, &seq) < 0 ? -1 : 0;
+        }
+        seq.count = (long long)count;
+
+        if (seq.count == 0)
+            return 0;
+
+        // Pick the formatter once; decorated numbers go through put_fmt
+        int style = seq.kind == SEQ_FIXED ? STYLE_FIXED : STYLE_INT;
+        if (opt_w) {
+            char tmp[64];
+            int w1 = (seq.kind == SEQ_FIXED ? put_fixed(tmp, seq.first, &seq) : put_ll(tmp, seq.first)) - tmp;
+            int w2 = (seq.kind == SEQ_FIXED ? put_fixed(tmp, lastv, &seq) : put_ll(tmp, lastv)) - tmp;
+            seq.width = w1 > w2 ? w1 : w2;
+            style = seq.kind == SEQ_FIXED ? STYLE_FMT : STYLE_PADDED;
+        } else if (fmt != NULL) {
+            if (!compile_format(&format, &seq, lastv)) {
+                seq.printf_fmt = format.long_fmt;
+                if (out_fd >= 0)
+                    dup2(out_fd, STDOUT_FILENO);
+                return run_printf(&seq);
+            }
+            style = STYLE_FMT;
+        }
+        seq.format_block = formatters[style][seq.seplen != 1];
+
+        // Size blocks so long decorated numbers do not need huge buffers
+        seq.max_len = num_len(&seq, 19, 1);
+        seq.block_nums = BLOCK_BYTES / seq.max_len;
+        if (seq.block_nums > BLOCK_NUMS)
+            seq.block_nums = BLOCK_NUMS;
+        if (seq.block_nums < 1)
+            seq.block_nums = 1;
+
+        if (out_fd >= 0)
+            return run_to_file(&seq, nthreads, out_fd, out_path);
+
+        // Small ranges are not worth starting threads for
+        if (nthreads > 1 && seq.count > seq.block_nums)
+            return run_parallel(&seq, nthreads, STDOUT_FILENO, NULL);
+        return run_serial(&seq);
     } else {
         // Do nothing
     }
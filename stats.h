@@ -0,0 +1,252 @@
+/*
+#  Title          : stats.h
+#  Author         : Brandon Cohen
+#  Created on     : December 22, 2023
+#  Description    : The --stats option shared by the programs here: phase times, system call and allocation counts,
+#                   bytes moved and peak RSS, printed as one line on stderr when the program exits.
+#  Purpose        : To see which part of a run is slow without running it under strace or perf.
+#  Usage          : #include "stats.h" after every other header, then call stats_init(&argc, argv) first in main().
+#  Build with     : Nothing extra; everything is static in this header.
+#  Modifications  :
+*/
+
+/*
+stats_init() takes --stats out of the arguments, so the program's own option parsing never sees
+it, and registers the report to run at exit. stats_phase("name") ends the phase that was running
+and starts the named one. A phase can be entered many times, and its times add up, so a program
+that samples in a loop just names the phase at the top of each part of the loop.
+
+The calls are counted by macros that replace read(), pread(), write(), pwrite(), lseek(),
+statx(), copy_file_range(), malloc(), calloc() and realloc() from here on with wrappers that
+count the call and the bytes, so no call site changes. That is why this header has to come
+after the system headers: they are included first, here, and their include guards keep them
+from being read again with the macros in place. The counters are updated with relaxed atomic
+adds, so threads can share them, and they are kept even without --stats since an add costs
+nothing next to a system call. Only the statx() latencies need a clock, so they are timed only
+with --stats, into a histogram of power-of-two nanosecond bins.
+
+The report is one line of key=value pairs starting with "stats:", so awk can pick fields out of
+it. Bytes count what read and write calls moved; data read through mmap() and text printed
+through stdio are not counted.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define STATS_PHASES 12
+#define STATS_BINS   40
+
+enum { ST_READ, ST_WRITE, ST_LSEEK, ST_STATX, ST_COPY, ST_ALLOC, ST_NCOUNTS };
+
+static const char *const stats_names[ST_NCOUNTS] = { "read", "write", "lseek", "statx", "copy", "alloc" };
+
+static struct {
+    int on;
+    const char *tool;
+    struct timespec start, phase_start;
+    int phase;                              // Running phase, or -1
+    int nphases;
+    const char *phase_names[STATS_PHASES];
+    double phase_ms[STATS_PHASES];
+    unsigned long long calls[ST_NCOUNTS];
+    unsigned long long bytes[ST_NCOUNTS];
+    unsigned long long statx_ns[STATS_BINS];
+    void (*extra)(FILE *);                  // Prints the program's own fields
+} stats = { .phase = -1 };
+
+static inline double stats_ms(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static inline void stats_count(int what, long long bytes) {
+    __atomic_fetch_add(&stats.calls[what], 1, __ATOMIC_RELAXED);
+    if (bytes > 0)
+        __atomic_fetch_add(&stats.bytes[what], (unsigned long long)bytes, __ATOMIC_RELAXED);
+}
+
+// End the running phase and start the one called name, which should be a string literal.
+static inline void stats_phase(const char *name) {
+    struct timespec now;
+    int i;
+
+    if (!stats.on)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (stats.phase >= 0)
+        stats.phase_ms[stats.phase] += stats_ms(&stats.phase_start, &now);
+    stats.phase_start = now;
+
+    for (i = 0; i < stats.nphases && strcmp(stats.phase_names[i], name) != 0; i++)
+        ;
+    if (i == stats.nphases && i < STATS_PHASES)
+        stats.phase_names[stats.nphases++] = name;
+    stats.phase = i < STATS_PHASES ? i : -1;
+}
+
+// Add fields of the program's own to the report. fn prints them as " key=value" pairs.
+static inline void stats_extra(void (*fn)(FILE *)) {
+    stats.extra = fn;
+}
+
+static void stats_report(void) {
+    struct timespec now;
+    struct rusage ru;
+
+    stats_phase("");
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &ru);
+
+    fprintf(stderr, "stats: tool=%s wall_ms=%.3f", stats.tool, stats_ms(&stats.start, &now));
+    for (int i = 0; i < stats.nphases; i++) {
+        if (stats.phase_names[i][0] != '\0')
+            fprintf(stderr, " phase_%s_ms=%.3f", stats.phase_names[i], stats.phase_ms[i]);
+    }
+
+    unsigned long long syscalls = 0;
+    for (int i = 0; i < ST_NCOUNTS; i++) {
+        fprintf(stderr, " %s=%llu", stats_names[i], stats.calls[i]);
+        if (i != ST_LSEEK && i != ST_STATX)
+            fprintf(stderr, " %s_bytes=%llu", stats_names[i], stats.bytes[i]);
+        if (i != ST_ALLOC)
+            syscalls += stats.calls[i];
+    }
+    fprintf(stderr, " syscalls=%llu", syscalls);
+    fprintf(stderr, " user_ms=%.3f sys_ms=%.3f peak_rss_kb=%ld",
+            ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3,
+            ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3, ru.ru_maxrss);
+
+    // Bin b holds the statx() calls that took less than 2^b ns, and at least half that
+    if (stats.calls[ST_STATX] > 0) {
+        const char *sep = "";
+        fprintf(stderr, " statx_ns=");
+        for (int b = 0; b < STATS_BINS; b++) {
+            if (stats.statx_ns[b] == 0)
+                continue;
+            fprintf(stderr, "%s%llu:%llu", sep, 1ULL << b, stats.statx_ns[b]);
+            sep = ",";
+        }
+    }
+
+    if (stats.extra != NULL)
+        stats.extra(stderr);
+    fputc('\n', stderr);
+}
+
+// Take --stats out of argv, which stays NULL terminated, and turn the report on if it was there.
+static inline void stats_init(int *argc, char *argv[]) {
+    int j = 1;
+
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            while (i < *argc)
+                argv[j++] = argv[i++];
+            break;
+        }
+        if (strcmp(argv[i], "--stats") == 0)
+            stats.on = 1;
+        else
+            argv[j++] = argv[i];
+    }
+    *argc = j;
+    argv[j] = NULL;
+
+    if (stats.on) {
+        const char *slash = strrchr(argv[0], '/');
+        stats.tool = slash != NULL ? slash + 1 : argv[0];
+        clock_gettime(CLOCK_MONOTONIC, &stats.start);
+        atexit(stats_report);
+    }
+}
+
+static inline ssize_t stats_read(int fd, void *buf, size_t n) {
+    ssize_t r = read(fd, buf, n);
+    stats_count(ST_READ, r);
+    return r;
+}
+
+static inline ssize_t stats_pread(int fd, void *buf, size_t n, off_t off) {
+    ssize_t r = pread(fd, buf, n, off);
+    stats_count(ST_READ, r);
+    return r;
+}
+
+static inline ssize_t stats_write(int fd, const void *buf, size_t n) {
+    ssize_t r = write(fd, buf, n);
+    stats_count(ST_WRITE, r);
+    return r;
+}
+
+static inline ssize_t stats_pwrite(int fd, const void *buf, size_t n, off_t off) {
+    ssize_t r = pwrite(fd, buf, n, off);
+    stats_count(ST_WRITE, r);
+    return r;
+}
+
+static inline off_t stats_lseek(int fd, off_t off, int whence) {
+    stats_count(ST_LSEEK, 0);
+    return lseek(fd, off, whence);
+}
+
+static inline ssize_t stats_copy_file_range(int in, off_t *in_off, int out, off_t *out_off,
+                                            size_t n, unsigned flags) {
+    ssize_t r = copy_file_range(in, in_off, out, out_off, n, flags);
+    stats_count(ST_COPY, r);
+    return r;
+}
+
+static inline int stats_statx(int dirfd, const char *path, int flags, unsigned mask, struct statx *st) {
+    struct timespec a, b;
+
+    if (!stats.on) {
+        stats_count(ST_STATX, 0);
+        return statx(dirfd, path, flags, mask, st);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    int r = statx(dirfd, path, flags, mask, st);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+
+    unsigned long long ns = (b.tv_sec - a.tv_sec) * 1000000000ULL + b.tv_nsec - a.tv_nsec;
+    int bin = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    __atomic_fetch_add(&stats.statx_ns[bin < STATS_BINS ? bin : STATS_BINS - 1], 1, __ATOMIC_RELAXED);
+    stats_count(ST_STATX, 0);
+    return r;
+}
+
+static inline void *stats_malloc(size_t n) {
+    stats_count(ST_ALLOC, n);
+    return malloc(n);
+}
+
+static inline void *stats_calloc(size_t n, size_t size) {
+    stats_count(ST_ALLOC, n * size);
+    return calloc(n, size);
+}
+
+static inline void *stats_realloc(void *p, size_t n) {
+    stats_count(ST_ALLOC, n);
+    return realloc(p, n);
+}
+
+#define read(fd, buf, n)                stats_read(fd, buf, n)
+#define pread(fd, buf, n, off)          stats_pread(fd, buf, n, off)
+#define write(fd, buf, n)               stats_write(fd, buf, n)
+#define pwrite(fd, buf, n, off)         stats_pwrite(fd, buf, n, off)
+#define lseek(fd, off, whence)          stats_lseek(fd, off, whence)
+#define copy_file_range(a, b, c, d, n, f) stats_copy_file_range(a, b, c, d, n, f)
+#define statx(dirfd, path, flags, mask, st) stats_statx(dirfd, path, flags, mask, st)
+#define malloc(n)                       stats_malloc(n)
+#define calloc(n, size)                 stats_calloc(n, size)
+#define realloc(p, n)                   stats_realloc(p, n)
+
+#endif
@@ -0,0 +1,406 @@
+/*
+#  Title          : toolbox.c
+#  Author         : Brandon Cohen
+#  Created on     : December 27, 2023
+#  Description    : One statically linked program that is fcompare, myseq and diffdate, picked by the name it is run as,
+#                   and that can also stay running and serve requests to run them.
+#  Purpose        : To take program loading and locale setup out of the cost of every call from a script.
+#  Usage          : ./toolbox tool [args ...]
+#                   ./toolbox --serve [socket]
+#                   fcompare, myseq or diffdate as a link to toolbox, with that program's arguments
+#  Build with     : gcc -O2 -static -pthread toolbox.c -o toolbox
+#                   ln -s toolbox fcompare; ln -s toolbox myseq; ln -s toolbox diffdate
+#  Modifications  :
+*/
+
+/*
+The programs are compiled into this file as they are: each .c is included with its main()
+renamed, and a table maps the names to them. Run through a link called myseq, toolbox looks at
+the last part of argv[0] and calls myseq's main() with the arguments unchanged, so scripts do
+not need to know. Being static, it starts without the dynamic loader resolving libc, and the
+programs share one copy of fastfmt.h and stats.h.
+
+setlocale() is replaced in the programs by a version that sets each category at most once and
+hands back the saved answer after that, since reading the locale files is the slow part of
+starting diffdate or fcompare.
+
+--serve reads one request per line, from stdin or from clients of a Unix socket. A request is a
+program name and its arguments, split on spaces, with '...' and "..." quoting and \ escapes as
+in the shell. Each request runs in a child forked from the server, with stdin from /dev/null and
+stdout and stderr going into a pipe, so the programs can keep calling exit() and keep their
+static state, and a crash only loses that request. The output is passed on as it comes, in
+chunks: a line with the number of bytes in the chunk, then the bytes. A line "0 status" ends the
+reply with the program's exit status, so the server holds no more than one pipe read of any
+reply however long the output is. The server reads the user's locale files the first time a
+request comes in, so no child forked after that reads them again. With a socket, every client
+gets its own process, and clients are served at the same time.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <locale.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_REQUEST 65536   // Longest request line
+#define MAX_ARGS    1024
+
+static const char *toolbox_locales[16];
+static int toolbox_locale_set[16];
+
+// setlocale() for the programs: each category is only set once, and later calls get the same answer
+static char *toolbox_setlocale(int category, const char *locale) {
+    if (category < 0 || category >= 16 || locale == NULL || strcmp(locale, "") != 0)
+        return setlocale(category, locale);
+    if (!toolbox_locale_set[category]) {
+        toolbox_locales[category] = setlocale(category, locale);
+        toolbox_locale_set[category] = 1;
+    }
+    return (char *)toolbox_locales[category];
+}
+
+#define setlocale(category, locale) toolbox_setlocale(category, locale)
+
+#define main fcompare_main
+#include "fcompare.c"
+#undef main
+
+#define main myseq_main
+#include "myseq.c"
+#undef main
+
+#define main diffdate_main
+#include "diffdate.c"
+#undef main
+
+#undef setlocale
+
+// From here on the server's own calls go around stats.h, so they are not counted in the programs' --stats
+
+static const struct {
+    const char *name;
+    int (*main)(int, char **);
+} tools[] = {
+    { "fcompare", fcompare_main },
+    { "myseq",    myseq_main },
+    { "diffdate", diffdate_main },
+};
+
+#define NTOOLS (int)(sizeof(tools) / sizeof(tools[0]))
+
+static int (*find_tool(const char *name))(int, char **) {
+    for (int i = 0; i < NTOOLS; i++)
+        if (strcmp(tools[i].name, name) == 0)
+            return tools[i].main;
+    return NULL;
+}
+
+static void toolbox_usage(void) {
+    fprintf(stderr, "./toolbox tool [args ...]\n");
+    fprintf(stderr, "./toolbox --serve [socket]\n");
+    fprintf(stderr, "Tools:");
+    for (int i = 0; i < NTOOLS; i++)
+        fprintf(stderr, " %s", tools[i].name);
+    fprintf(stderr, "\n");
+}
+
+// Split line into words the way the shell would, in place. Returns the word count, or -1.
+static int split_request(char *line, char **argv, int max) {
+    int argc = 0;
+    char *in = line, *out = line;
+
+    for (;;) {
+        while (*in == ' ' || *in == '\t')
+            in++;
+        if (*in == '\0')
+            break;
+        if (argc == max - 1)
+            return -1;
+        argv[argc++] = out;
+
+        // Copy one word, dropping its quotes and escapes
+        char quote = 0;
+        while (*in != '\0' && (quote || (*in != ' ' && *in != '\t'))) {
+            if (quote == '\'') {
+                if (*in == '\'')
+                    quote = 0;
+                else
+                    *out++ = *in;
+                in++;
+            } else if (*in == '\\' && in[1] != '\0' && (!quote || in[1] == '"' || in[1] == '\\')) {
+                *out++ = in[1];
+                in += 2;
+            } else if (*in == '"' || (*in == '\'' && !quote)) {
+                quote = quote ? 0 : *in;
+                in++;
+            } else {
+                *out++ = *in++;
+            }
+        }
+        if (quote)
+            return -1;
+        if (*in != '\0')
+            in++;
+        *out++ = '\0';
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = (write)(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send one chunk of output: "length\n" and then the bytes
+static int send_chunk(int fd, const char *out, size_t len) {
+    char head[32];
+    int n = snprintf(head, sizeof(head), "%zu\n", len);
+    if (send_all(fd, head, n) < 0 || send_all(fd, out, len) < 0)
+        return -1;
+    return 0;
+}
+
+// End a reply with the exit status
+static int send_status(int fd, int status) {
+    char head[32];
+    int n = snprintf(head, sizeof(head), "0 %d\n", status);
+    return send_all(fd, head, n);
+}
+
+// A whole reply from the server itself, for requests that never reach a program
+static int reply(int fd, int status, const char *msg, size_t len) {
+    if (send_chunk(fd, msg, len) < 0)
+        return -1;
+    return send_status(fd, status);
+}
+
+// Run one request line in a child and send its reply to fd
+static int serve_request(char *line, int fd) {
+    static locale_t user_locale;
+    static char out[65536];
+    char *argv[MAX_ARGS];
+    int argc = split_request(line, argv, MAX_ARGS);
+
+    if (argc == 0)
+        return 0;
+    if (argc < 0) {
+        static const char msg[] = "toolbox: unmatched quote or too many arguments\n";
+        return reply(fd, 2, msg, sizeof(msg) - 1);
+    }
+    int (*tool)(int, char **) = find_tool(argv[0]);
+    if (tool == NULL) {
+        char msg[256];
+        int n = snprintf(msg, sizeof(msg), "toolbox: no tool called %.200s\n", argv[0]);
+        return reply(fd, 127, msg, n);
+    }
+
+    // Read the user's locale files the first time it could be needed. The server stays in the
+    // C locale, so each child still gets only the categories its program asks for, but glibc
+    // keeps what it loaded and the child's setlocale() finds it already in memory.
+    if (user_locale == (locale_t)0)
+        user_locale = newlocale(LC_ALL_MASK, "", (locale_t)0);
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDONLY);
+        if (null < 0 || dup2(null, STDIN_FILENO) < 0 || dup2(pipefd[1], STDOUT_FILENO) < 0 ||
+            dup2(pipefd[1], STDERR_FILENO) < 0)
+            _exit(126);
+        // O_CLOEXEC does nothing without an exec, and a read end left open here would keep
+        // SIGPIPE from ever stopping the child
+        close(null);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        signal(SIGPIPE, SIG_DFL);
+        exit(tool(argc, argv));
+    }
+    close(pipefd[1]);
+
+    // Pass the output on as it comes. If the client has gone, closing the pipe stops the child
+    // with SIGPIPE on its next write.
+    int rc = 0;
+    for (;;) {
+        ssize_t n = (read)(pipefd[0], out, sizeof(out));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        if (send_chunk(fd, out, n) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    close(pipefd[0]);
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+        ;
+    if (rc < 0)
+        return -1;
+    return send_status(fd, WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus));
+}
+
+// Answer every request line read from in, replying on out
+static void serve_stream(int in, int out) {
+    static char buf[MAX_REQUEST + 1];
+    size_t have = 0;
+
+    for (;;) {
+        char *nl = memchr(buf, '\n', have);
+        if (nl == NULL) {
+            if (have == MAX_REQUEST) {
+                fprintf(stderr, "toolbox: request longer than %d bytes\n", MAX_REQUEST);
+                return;
+            }
+            ssize_t n = (read)(in, buf + have, MAX_REQUEST - have);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                // A last request without a newline still counts
+                if (have > 0) {
+                    buf[have] = '\0';
+                    serve_request(buf, out);
+                }
+                return;
+            }
+            have += n;
+            continue;
+        }
+
+        *nl = '\0';
+        if (nl > buf && nl[-1] == '\r')
+            nl[-1] = '\0';
+        if (serve_request(buf, out) < 0)
+            return;
+        have -= nl + 1 - buf;
+        memmove(buf, nl + 1, have);
+    }
+}
+
+static int serve_socket(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return EXIT_FAILURE;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Only a socket left behind by an earlier server is replaced, never a file or a live server
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s: exists and is not a socket\n", path);
+            return EXIT_FAILURE;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "%s: another server is listening there\n", path);
+            return EXIT_FAILURE;
+        }
+        if (probe >= 0)
+            close(probe);
+        if (unlink(path) < 0) {
+            perror(path);
+            return EXIT_FAILURE;
+        }
+    } else if (errno != ENOENT) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    for (;;) {
+        int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return EXIT_FAILURE;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fd);
+            serve_stream(client, client);
+            _exit(0);
+        }
+        if (pid < 0)
+            perror("fork");
+        close(client);
+
+        // Collect clients that have finished
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *slash = strrchr(argv[0], '/');
+    const char *name = slash != NULL ? slash + 1 : argv[0];
+    int (*tool)(int, char **) = find_tool(name);
+
+    // Run as one of the tools, through a link
+    if (tool != NULL)
+        return tool(argc, argv);
+
+    if (argc >= 2 && strcmp(argv[1], "--serve") == 0) {
+        if (argc > 3) {
+            toolbox_usage();
+            return EXIT_FAILURE;
+        }
+        // A client that goes away must not take the server with it
+        signal(SIGPIPE, SIG_IGN);
+        if (argc == 3)
+            return serve_socket(argv[2]);
+        serve_stream(STDIN_FILENO, STDOUT_FILENO);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc >= 2 && (tool = find_tool(argv[1])) != NULL)
+        return tool(argc - 1, argv + 1);
+
+    toolbox_usage();
+    return EXIT_FAILURE;
+}